@@ -1,7 +1,32 @@
 #include <iostream>
 #include <map>
 #include <iomanip>
-
+#include <cmath>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <numeric>
+#include <chrono>
+#include <future>
+#include <thread>
+#include <cstdint>
+#include <cstdio>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "WarCraft.h"
+#include "WarCraft_io.h"
+
+// Everything but the warcraft_ functions at the end has internal linkage, so that the library exports nothing else.
+namespace
+{
 const int nWeapons = 3;
 const int nWarriors = 5;
 
@@ -24,7 +49,17 @@ const Result Lose = 1 << 2;
 const Result Tie = 1 << 3;
 const Result Win = 1 << 4;
 
-inline void print_time() { std::cout << std::setw(3) << std::setfill('0') << std::right << hour << ':' << std::setw(2) << std::setfill('0') << std::right << minute << ' '; }
+inline void print_time(std::ostream &out, const warcraft_event &event) { out << std::setw(3) << std::setfill('0') << std::right << event.hour << ':' << std::setw(2) << std::setfill('0') << std::right << event.minute << ' '; }
+
+inline warcraft_event make_event(const int &kind)
+{
+    warcraft_event event = {};
+    event.kind = kind, event.hour = hour, event.minute = minute;
+    return event;
+}
+
+// Hands an event to the library caller, or prints its line.
+void emit(const warcraft_event &event);
 
 inline bool time_not_valid() { return 60 * hour + minute > time_limit; }
 
@@ -53,6 +88,202 @@ class Weapon;
 class Warrior;
 class City;
 class Headquarter;
+class Roster;
+class Shard;
+class ShardedEngine;
+class SparseEngine;
+class LineWriter;
+
+struct Bench;
+
+// Whether a report of this many lines is printed by print_weapons rather than line by line through emit.
+bool report_in_chunks(const int &lines);
+
+// Prints the weapons lines of the warriors in this order, formatted in chunks on several threads.
+void print_weapons(const std::vector<Warrior *> &warriors);
+
+// The cities held by this process: cities[i] is the city with index first_city + i.
+City *cities = nullptr;
+
+int first_city = 0, held_cities = 0;
+
+inline City *city_at(const int &index);
+
+inline bool holds_city(const int &index) { return index >= first_city && index < first_city + held_cities; }
+
+// Balance counters for the current case, bumped where the matching line is printed.
+class Stats
+{
+public:
+    // Kills by the killer's type and deaths by the victim's type, whether by attack, arrow or bomb.
+    long long kills[nWarriors] = {}, deaths[nWarriors] = {};
+
+    long long bombs = 0, arrow_kills = 0, lion_escapes = 0, dragon_yells = 0;
+
+    long long income[2] = {};
+
+    // The minute each side took the enemy headquarter, or -1.
+    int conquest[2] = {-1, -1};
+
+    // Flags raised, by city index.
+    std::map<int, int> flags;
+
+    void kill(const warrior_type &killer, const warrior_type &victim) { ++kills[killer], ++deaths[victim]; }
+
+    void save(Archive &out)
+    {
+        for (int i = 0; i < nWarriors; ++i)
+        {
+            out << kills[i] << deaths[i];
+        }
+        out << bombs << arrow_kills << lion_escapes << dragon_yells << income[red] << income[blue] << conquest[red] << conquest[blue];
+        out << uint64_t(flags.size());
+        for (auto p = flags.begin(); p != flags.end(); ++p)
+        {
+            out << p->first << p->second;
+        }
+    }
+
+    // Adds counters saved by save(), as collected by a shard or kept in the cache.
+    void merge(Archive &in)
+    {
+        long long value;
+        for (int i = 0; i < nWarriors; ++i)
+        {
+            in >> value, kills[i] += value;
+            in >> value, deaths[i] += value;
+        }
+        long long *sums[] = {&bombs, &arrow_kills, &lion_escapes, &dragon_yells, income + red, income + blue};
+        for (long long *sum : sums)
+        {
+            in >> value, *sum += value;
+        }
+        for (int type = red; type <= blue; ++type)
+        {
+            int minute;
+            in >> minute;
+            if (minute >= 0)
+            {
+                conquest[type] = minute;
+            }
+        }
+        uint64_t n;
+        in >> n;
+        for (int index, count; n-- && in.ok();)
+        {
+            in >> index >> count;
+            if (count < 0 || count > INT32_MAX - flags[index])
+            {
+                in.fail();
+                break;
+            }
+            flags[index] += count;
+        }
+    }
+
+    void print(std::ostream &out, const int &k);
+};
+
+Stats stats;
+
+// A live count and the highest it has been.
+class Gauge
+{
+public:
+    long long live = 0, peak = 0;
+
+    void add(const long long &n)
+    {
+        live += n;
+        peak = std::max(peak, live);
+    }
+
+    void remove(const long long &n) { live -= n; }
+
+    void save(Archive &out) { out << live << peak; }
+
+    // Adds another process's gauge; the peaks add up to an upper bound.
+    void merge(Archive &in)
+    {
+        long long _live, _peak;
+        in >> _live >> _peak;
+        live += _live, peak += _peak;
+    }
+};
+
+// What the current case holds in memory, kept by the constructors and destructors. Object bytes are
+// counted at their class size and pool nodes at an estimate of a tree node; roster and lane slots count capacity.
+class Memory
+{
+public:
+    static const long long warrior_size[nWarriors], weapon_size[nWeapons], city_size, pool_node_size;
+
+    Gauge warriors[nWarriors], weapons[nWeapons], cities, pool_nodes, roster_slots, lane_slots;
+
+    // Bytes of all of the above.
+    Gauge total;
+
+    // Live bytes at the end of each hour, or when the case stopped within it.
+    std::vector<long long> hourly;
+
+    void add(Gauge &gauge, const long long &count, const long long &size) { gauge.add(count), total.add(count * size); }
+
+    void remove(Gauge &gauge, const long long &count, const long long &size) { gauge.remove(count), total.remove(count * size); }
+
+    void gauges(std::vector<Gauge *> &all)
+    {
+        for (int i = 0; i < nWarriors; ++i)
+        {
+            all.push_back(warriors + i);
+        }
+        for (int i = 0; i < nWeapons; ++i)
+        {
+            all.push_back(weapons + i);
+        }
+        Gauge *rest[] = {&cities, &pool_nodes, &roster_slots, &lane_slots, &total};
+        all.insert(all.end(), rest, rest + 5);
+    }
+
+    // Returns 0 if the live total is over the limit, which is 0 for none.
+    bool sample(const long long &limit);
+
+    void save(Archive &out)
+    {
+        std::vector<Gauge *> all;
+        gauges(all);
+        for (Gauge *gauge : all)
+        {
+            gauge->save(out);
+        }
+        out << uint64_t(hourly.size());
+        for (long long bytes : hourly)
+        {
+            out << bytes;
+        }
+    }
+
+    void merge(Archive &in)
+    {
+        std::vector<Gauge *> all;
+        gauges(all);
+        for (Gauge *gauge : all)
+        {
+            gauge->merge(in);
+        }
+        uint64_t n;
+        in >> n;
+        hourly.resize(std::max<size_t>(hourly.size(), n));
+        for (uint64_t i = 0; i < n; ++i)
+        {
+            long long bytes;
+            in >> bytes, hourly[i] += bytes;
+        }
+    }
+
+    void print(std::ostream &out, const int &k);
+};
+
+Memory memory;
 
 class Weapon
 {
@@ -62,16 +293,21 @@ protected:
     weapon_type type;
 
 public:
-    Weapon(const int &value, const weapon_type &_type) : attack_value(value), type(_type) {}
+    Weapon(const int &value, const weapon_type &_type) : attack_value(value), type(_type) { memory.add(memory.weapons[type], 1, Memory::weapon_size[type]); }
 
-    virtual ~Weapon() {}
+    virtual ~Weapon() { memory.remove(memory.weapons[type], 1, Memory::weapon_size[type]); }
 
-    virtual void print_self() = 0;
+    // What the weapon report shows: the sword's attack, 1 for a bomb, the arrows left.
+    virtual int report_value() = 0;
 
     virtual void utilize() = 0;
 
     virtual bool is_used_up() = 0;
 
+    virtual void save(Archive &out) = 0;
+
+    static Weapon *restore(const weapon_type &_type, Archive &in);
+
     friend class Warrior;
 };
 class Sword : public Weapon
@@ -83,7 +319,9 @@ public:
 
     bool is_used_up() override { return !attack_value; }
 
-    void print_self() override { std::cout << "sword(" << attack_value << ')'; }
+    int report_value() override { return attack_value; }
+
+    void save(Archive &out) override { out << attack_value; }
 };
 class Bomb : public Weapon
 {
@@ -97,7 +335,9 @@ public:
 
     bool is_used_up() override { return _is_used_up; }
 
-    void print_self() override { std::cout << "bomb"; }
+    int report_value() override { return 1; }
+
+    void save(Archive &) override {}
 };
 class Arrow : public Weapon
 {
@@ -107,13 +347,43 @@ private:
 public:
     Arrow() : Weapon(arrow_attack, arrow) {}
 
+    Arrow(const int &left) : Weapon(arrow_attack, arrow), left_num(left) {}
+
     void utilize() override { --left_num; }
 
     bool is_used_up() override { return !left_num; }
 
-    void print_self() override { std::cout << "arrow(" << left_num << ')'; }
+    int report_value() override { return left_num; }
+
+    void save(Archive &out) override { out << left_num; }
 };
 
+Weapon *Weapon::restore(const weapon_type &_type, Archive &in)
+{
+    int value;
+    switch (_type)
+    {
+    case sword:
+        in >> value;
+        if (value <= 0)
+        {
+            in.fail();
+        }
+        return new Sword(value);
+
+    case bomb:
+        return new Bomb;
+
+    default:
+        in >> value;
+        if (value < 1 || value > 3)
+        {
+            in.fail();
+        }
+        return new Arrow(value);
+    }
+}
+
 class Warrior
 {
 protected:
@@ -121,15 +391,21 @@ protected:
 
     Headquarter *pHeadquarter;
 
-    City *pCity;
-
     warrior_type type;
 
-    int id, elements, force;
+    int id, elements, force, slot, birth;
 
     Weapon *pWeapons[nWeapons];
 
-    bool move = 0;
+    // Leaves every field but the type to load().
+    Warrior(Headquarter *headquarter, const warrior_type &_type) : pHeadquarter(headquarter), type(_type)
+    {
+        memory.add(memory.warriors[type], 1, Memory::warrior_size[type]);
+        for (int i = 0; i < nWeapons; ++i)
+        {
+            pWeapons[i] = nullptr;
+        }
+    }
 
 public:
     static int elements_value[nWarriors], force_value[nWarriors];
@@ -169,6 +445,51 @@ public:
         pWeapons[weapon] = nullptr;
     }
 
+    void discard_weapons()
+    {
+        for (int i = 0; i < nWeapons; ++i)
+        {
+            delete pWeapons[i];
+            pWeapons[i] = nullptr;
+        }
+    }
+
+    // Writes the type first, so that restore() knows what to build.
+    virtual void save(Archive &out)
+    {
+        out << type << id << birth << elements << force;
+        for (int i = 0; i < nWeapons; ++i)
+        {
+            out << bool(pWeapons[i]);
+            if (pWeapons[i])
+            {
+                pWeapons[i]->save(out);
+            }
+        }
+    }
+
+    // Reads back what save() wrote after the type.
+    virtual void load(Archive &in)
+    {
+        in >> id >> birth >> elements >> force;
+        if (elements < 0 || force < 0)
+        {
+            in.fail();
+        }
+        discard_weapons();
+        for (int i = 0; i < nWeapons; ++i)
+        {
+            bool present;
+            in >> present;
+            if (present)
+            {
+                pWeapons[i] = Weapon::restore(weapon_type(i), in);
+            }
+        }
+    }
+
+    static Warrior *restore(Headquarter *headquarter, Archive &in);
+
     void hurted(const int &value) { elements = std::max(0, elements - value); }
 
     void gain_elements(const int &value) { elements += value; }
@@ -222,52 +543,39 @@ public:
 
     void report_shot(Warrior *enemy)
     {
-        print_time(), print_self();
-        std::cout << " shot";
+        warcraft_event event = describe(WARCRAFT_SHOT);
+        event.object = enemy->who();
         if (enemy->is_dead())
         {
-            std::cout << " and killed ";
-            enemy->print_self();
+            stats.kill(type, enemy->type), ++stats.arrow_kills;
+            event.value = 1;
         }
-        std::cout << std::endl;
+        emit(event);
     }
 
-    void report_weapons()
+    warcraft_event weapons_event()
     {
-        print_time(), print_self();
-        bool has_weapons = 0, first_weapon = 1;
-        std::cout << " has ";
+        warcraft_event event = describe(WARCRAFT_WEAPONS);
         for (int i = 0; i < nWeapons; ++i)
         {
-            has_weapons |= pWeapons[i] != nullptr;
-        }
-        if (!has_weapons)
-        {
-            std::cout << "no weapon" << std::endl;
-            return;
-        }
-        for (int i = nWeapons - 1; i >= 0; --i)
-        {
-            if (!pWeapons[i])
-            {
-                continue;
-            }
-            if (first_weapon)
-            {
-                first_weapon = 0;
-            }
-            else
-            {
-                std::cout << ',';
-            }
-            pWeapons[i]->print_self();
+            event.weapons[i] = pWeapons[i] ? pWeapons[i]->report_value() : -1;
         }
-        std::cout << std::endl;
+        return event;
     }
 
+    void report_weapons() { emit(weapons_event()); }
+
     virtual void pick_weapon();
 
-    void print_self();
+    warcraft_warrior who();
+
+    // An event about this warrior at the current time.
+    warcraft_event describe(const int &kind)
+    {
+        warcraft_event event = make_event(kind);
+        event.subject = who();
+        return event;
+    }
 
     bool try_to_shot(Warrior *enemy);
 
@@ -283,9 +591,7 @@ public:
 
     void send_elements_to_headquarter(const int &value);
 
-    void report_death();
-
-    bool march();
+    void report_death(Warrior *killer);
 
     virtual void during_march() {}
 
@@ -299,9 +605,29 @@ public:
 
     int position();
 
+    City *city();
+
+    bool has_marched();
+
     friend class City;
 
     friend class Headquarter;
+
+    friend class Roster;
+
+    friend class Stats;
+
+    friend class Memory;
+
+    friend void print_warrior(std::ostream &out, const warcraft_warrior &warrior);
+
+    friend void print_event(std::ostream &out, const warcraft_event &event);
+
+    friend void format_weapons(LineWriter &line, const warcraft_event &event);
+
+    friend class SparseEngine;
+
+    friend struct Bench;
 };
 class Dragon : public Warrior
 {
@@ -312,7 +638,22 @@ public:
     Dragon(Headquarter *pHeadquarter, const int &id, const double &_morale) : Warrior(pHeadquarter, id, dragon), morale(_morale)
     {
         get_weapon(weapon_type(id % nWeapons));
-        std::cout << "Its morale is " << std::fixed << std::setprecision(2) << morale << std::endl;
+        warcraft_event event = describe(WARCRAFT_MORALE);
+        event.morale = morale;
+        emit(event);
+    }
+
+    Dragon(Headquarter *pHeadquarter) : Warrior(pHeadquarter, dragon) {}
+
+    void save(Archive &out) override { Warrior::save(out), out << morale; }
+
+    void load(Archive &in) override
+    {
+        Warrior::load(in), in >> morale;
+        if (!std::isfinite(morale))
+        {
+            in.fail();
+        }
     }
 
     void after_attack(Warrior *enemy, const Result &result) override;
@@ -328,6 +669,8 @@ public:
         get_weapon(weapon_type((id + 1) % nWeapons));
     }
 
+    Ninja(Headquarter *pHeadquarter) : Warrior(pHeadquarter, ninja) {}
+
     void passively_attack(Warrior *enemy) override {}
 
     int passively_attack_value() override { return 0; }
@@ -345,6 +688,12 @@ public:
         get_weapon(weapon_type(id % nWeapons));
     }
 
+    Iceman(Headquarter *pHeadquarter) : Warrior(pHeadquarter, iceman) {}
+
+    void save(Archive &out) override { Warrior::save(out), out << count_steps; }
+
+    void load(Archive &in) override { Warrior::load(in), in >> count_steps; }
+
     void during_march() override
     {
         ++count_steps;
@@ -367,9 +716,17 @@ public:
     Lion(Headquarter *pHeadquarter, const int &id, const int &_loyalty) : Warrior(pHeadquarter, id, lion), loyalty(_loyalty)
     {
         record_elements = elements;
-        std::cout << "Its loyalty is " << loyalty << std::endl;
+        warcraft_event event = describe(WARCRAFT_LOYALTY);
+        event.value = loyalty;
+        emit(event);
     }
 
+    Lion(Headquarter *pHeadquarter) : Warrior(pHeadquarter, lion) {}
+
+    void save(Archive &out) override { Warrior::save(out), out << loyalty << record_elements; }
+
+    void load(Archive &in) override { Warrior::load(in), in >> loyalty >> record_elements; }
+
     void refresh_record_elements() override { record_elements = elements; }
 
     void after_attack(Warrior *enemy, const Result &result) override
@@ -398,8 +755,36 @@ class Wolf : public Warrior
 {
 public:
     Wolf(Headquarter *pHeadquarter, const int &id) : Warrior(pHeadquarter, id, wolf) {}
+
+    Wolf(Headquarter *pHeadquarter) : Warrior(pHeadquarter, wolf) {}
 };
 
+Warrior *Warrior::restore(Headquarter *headquarter, Archive &in)
+{
+    warrior_type _type;
+    in.read_enum(_type, wolf);
+    Warrior *warrior;
+    switch (_type)
+    {
+    case dragon:
+        warrior = new Dragon(headquarter);
+        break;
+    case ninja:
+        warrior = new Ninja(headquarter);
+        break;
+    case iceman:
+        warrior = new Iceman(headquarter);
+        break;
+    case lion:
+        warrior = new Lion(headquarter);
+        break;
+    default:
+        warrior = new Wolf(headquarter);
+    }
+    warrior->load(in);
+    return warrior;
+}
+
 class City
 {
 private:
@@ -407,8 +792,6 @@ private:
 
     int index, elements = 0;
 
-    Warrior *pWarriors[2];
-
     city_type flag = neutral, curr_win = neutral, prev_win = neutral;
 
     Result state = Nothing;
@@ -421,22 +804,25 @@ public:
     City()
     {
         index = ++count;
-        pWarriors[red] = pWarriors[blue] = nullptr;
+        memory.add(memory.cities, 1, Memory::city_size);
+    }
+
+    // Allocates n cities numbered from first.
+    static City *build(const int &first, const int &n)
+    {
+        count = first - 1;
+        return new City[n];
     }
 
     ~City()
     {
         --count;
-        if (pWarriors[red])
-        {
-            delete pWarriors[red];
-        }
-        if (pWarriors[blue])
-        {
-            delete pWarriors[blue];
-        }
+        clear_weapons();
+        memory.remove(memory.cities, 1, Memory::city_size);
     }
 
+    Warrior *warrior(const int &side);
+
     void clear_weapons()
     {
         for (auto p = weapon_pool.begin(); p != weapon_pool.end(); ++p)
@@ -446,24 +832,24 @@ public:
                 delete p->second;
             }
         }
+        memory.remove(memory.pool_nodes, weapon_pool.size(), Memory::pool_node_size);
         weapon_pool.clear();
     }
 
     city_type active_attacker_type() { return flag == neutral ? city_type((index & 1) ^ 1) : flag; }
 
-    void print_self() { std::cout << "city " << index; }
-
     void lion_escape()
     {
         for (int i = 0; i < 2; ++i)
         {
-            if (!pWarriors[i] || !pWarriors[i]->should_escape())
+            Warrior *escapee = warrior(i);
+            if (!escapee || !escapee->should_escape())
             {
                 continue;
             }
-            print_time(), pWarriors[i]->print_self();
-            std::cout << " ran away" << std::endl;
-            delete pWarriors[i];
+            ++stats.lion_escapes;
+            emit(escapee->describe(WARCRAFT_RAN_AWAY));
+            delete escapee;
         }
     }
 
@@ -475,15 +861,16 @@ public:
         {
             return;
         }
-        if (pWarriors[red] && !pWarriors[blue])
+        Warrior *Red = warrior(red), *Blue = warrior(blue);
+        if (Red && !Blue)
         {
-            pWarriors[red]->send_elements_to_headquarter(elements);
+            Red->send_elements_to_headquarter(elements);
             elements = 0;
             return;
         }
-        if (pWarriors[blue] && !pWarriors[red])
+        if (Blue && !Red)
         {
-            pWarriors[blue]->send_elements_to_headquarter(elements);
+            Blue->send_elements_to_headquarter(elements);
             elements = 0;
             return;
         }
@@ -491,22 +878,23 @@ public:
 
     void warrior_arrive()
     {
-        if (pWarriors[red] && pWarriors[red]->move)
-        {
-            pWarriors[red]->report_arrival();
-        }
-        if (pWarriors[blue] && pWarriors[blue]->move)
+        for (int i = 0; i < 2; ++i)
         {
-            pWarriors[blue]->report_arrival();
+            Warrior *arrival = warrior(i);
+            if (arrival && arrival->has_marched())
+            {
+                arrival->during_march();
+                arrival->report_arrival();
+            }
         }
     }
 
     void warrior_shot()
     {
         City *Next = index == nCities + 1 ? nullptr : this + 1;
-        if (pWarriors[red] && Next != nullptr && Next->pWarriors[blue])
+        Warrior *Red = warrior(red), *Blue = Next != nullptr ? Next->warrior(blue) : nullptr;
+        if (Red && Blue)
         {
-            Warrior *Red = pWarriors[red], *Blue = Next->pWarriors[blue];
             if (Red->try_to_shot(Blue))
             {
                 Blue->refresh_record_elements();
@@ -520,41 +908,42 @@ public:
         }
         if (blue_report_shot)
         {
-            Warrior *Red = (this - 1)->pWarriors[red];
-            pWarriors[blue]->report_shot(Red);
+            warrior(blue)->report_shot((this - 1)->warrior(red));
             blue_report_shot = 0;
         }
     }
 
     void warrior_explode()
     {
-        if (!pWarriors[red] || !pWarriors[blue])
+        Warrior *Red = warrior(red), *Blue = warrior(blue);
+        if (!Red || !Blue)
         {
             return;
         }
         city_type active = active_attacker_type();
-        bool explode = pWarriors[red]->try_to_use_bomb(pWarriors[blue], active) | pWarriors[blue]->try_to_use_bomb(pWarriors[red], active);
+        bool explode = Red->try_to_use_bomb(Blue, active) | Blue->try_to_use_bomb(Red, active);
         if (explode)
         {
-            delete pWarriors[red];
-            delete pWarriors[blue];
+            delete Red;
+            delete Blue;
         }
     }
 
     void warrior_fight()
     {
-        if (!pWarriors[red] || !pWarriors[blue])
+        Warrior *Red = warrior(red), *Blue = warrior(blue);
+        if (!Red || !Blue)
         {
             raise_flag();
             return;
         }
-        if (pWarriors[red]->is_dead() || pWarriors[blue]->is_dead())
+        if (Red->is_dead() || Blue->is_dead())
         {
             after_fight();
             return;
         }
         city_type active_type = active_attacker_type();
-        Warrior *active = pWarriors[active_type], *passive = pWarriors[active_type ^ 1];
+        Warrior *active = warrior(active_type), *passive = warrior(active_type ^ 1);
         active->actively_attack(passive);
         if (passive->is_dead())
         {
@@ -568,7 +957,7 @@ public:
     void after_fight()
     {
         city_type active_type = active_attacker_type();
-        Warrior *active = pWarriors[active_type], *passive = pWarriors[active_type ^ 1];
+        Warrior *active = warrior(active_type), *passive = warrior(active_type ^ 1);
         if (active->is_dead() && passive->is_dead())
         {
         }
@@ -606,123 +995,489 @@ public:
         prev_win = curr_win, curr_win = neutral, state = Nothing;
     }
 
+    // Writes the city between two hours as if its battle record had been cleared, which FusedEngine leaves
+    // until the next fight.
+    void save(Archive &out)
+    {
+        out << elements << flag << (state == Nothing ? prev_win : curr_win) << blue_report_shot << uint64_t(weapon_pool.size());
+        for (auto p = weapon_pool.begin(); p != weapon_pool.end(); ++p)
+        {
+            out << p->first;
+            p->second->save(out);
+        }
+    }
+
+    void load(Archive &in)
+    {
+        uint64_t n;
+        in >> elements;
+        in.read_enum(flag, neutral).read_enum(prev_win, neutral) >> blue_report_shot >> n;
+        // No shot report is pending between two hours, and a city gains at most 10 elements an hour.
+        if (elements < 0 || elements > 10 * (time_limit / 60 + 1) || blue_report_shot)
+        {
+            in.fail();
+        }
+        curr_win = neutral, state = Nothing;
+        clear_weapons();
+        while (n-- && in.ok())
+        {
+            weapon_type type;
+            in.read_enum(type, arrow);
+            if (!in.ok() || weapon_pool.count(type))
+            {
+                in.fail();
+                break;
+            }
+            weapon_pool.emplace(type, Weapon::restore(type, in));
+            memory.add(memory.pool_nodes, 1, Memory::pool_node_size);
+        }
+    }
+
     friend class Warrior;
 
     friend class Headquarter;
+
+    friend class Shard;
+
+    friend class SparseEngine;
+
+    friend struct Bench;
 };
 
-class Headquarter
-{
-private:
-    static std::string headquarter_name[2];
+inline City *city_at(const int &index) { return cities + (index - first_city); }
 
-    static warrior_type produce_order[2][nWarriors];
+const long long Memory::warrior_size[nWarriors] = {sizeof(Dragon), sizeof(Ninja), sizeof(Iceman), sizeof(Lion), sizeof(Wolf)};
 
-    City *pCity;
+const long long Memory::weapon_size[nWeapons] = {sizeof(Sword), sizeof(Bomb), sizeof(Arrow)};
 
-    city_type type;
+const long long Memory::city_size = sizeof(City);
 
-    warrior_type *order;
+const long long Memory::pool_node_size = 4 * sizeof(void *) + sizeof(std::pair<const weapon_type, Weapon *>);
 
-    int elements = init_elements, warriors = 0, index = 0, elements_buffer = 0;
+// Warriors of one side in id order. Dead warriors leave tombstones, which are squeezed out as soon as they outnumber the living,
+// so no warrior may die while the roster is being walked.
+class Roster
+{
+private:
+    std::vector<Warrior *> slots;
 
-    std::map<int, Warrior *> pWarriors;
+    int live = 0;
 
-public:
-    Headquarter(City *city, const city_type &_type) : pCity(city), type(_type)
+    void compact()
     {
-        pCity->flag = type;
-        order = produce_order[type];
+        int n = 0;
+        for (Warrior *warrior : slots)
+        {
+            if (warrior)
+            {
+                warrior->slot = n;
+                slots[n++] = warrior;
+            }
+        }
+        slots.resize(n);
     }
 
-    void produce()
+public:
+    class iterator
     {
-        warrior_type _type = order[index];
-        int cost = Warrior::elements_value[_type];
-        if (elements < cost)
+    private:
+        Warrior *const *slots;
+
+        int i, last, step;
+
+        void skip()
         {
-            return;
+            while (i != last && !slots[i])
+            {
+                i += step;
+            }
+        }
+
+    public:
+        iterator(Warrior *const *_slots, const int &_i, const int &_last, const int &_step) : slots(_slots), i(_i), last(_last), step(_step) { skip(); }
+
+        Warrior *operator*() const { return slots[i]; }
+
+        iterator &operator++()
+        {
+            i += step;
+            skip();
+            return *this;
+        }
+
+        bool operator!=(const iterator &other) const { return i != other.i; }
+    };
+
+    class range
+    {
+    private:
+        iterator first, last;
+
+    public:
+        range(const iterator &_first, const iterator &_last) : first(_first), last(_last) {}
+
+        iterator begin() const { return first; }
+
+        iterator end() const { return last; }
+    };
+
+    ~Roster() { memory.remove(memory.roster_slots, slots.capacity(), sizeof(Warrior *)); }
+
+    void push(Warrior *warrior)
+    {
+        warrior->slot = slots.size();
+        size_t capacity = slots.capacity();
+        slots.push_back(warrior);
+        memory.add(memory.roster_slots, slots.capacity() - capacity, sizeof(Warrior *));
+        ++live;
+    }
+
+    void remove(Warrior *warrior)
+    {
+        slots[warrior->slot] = nullptr;
+        --live;
+        if (slots.size() >= 64 && int(slots.size()) - live > live)
+        {
+            compact();
+        }
+    }
+
+    bool empty() const { return !live; }
+
+    int size() const { return live; }
+
+    iterator begin() const { return iterator(slots.data(), 0, slots.size(), 1); }
+
+    iterator end() const { return iterator(slots.data(), slots.size(), slots.size(), 1); }
+
+    range reversed() const { return range(iterator(slots.data(), int(slots.size()) - 1, -1, -1), iterator(slots.data(), -1, -1, -1)); }
+};
+
+class Headquarter
+{
+private:
+    static std::string headquarter_name[2];
+
+    static warrior_type produce_order[2][nWarriors];
+
+    city_type type;
+
+    warrior_type *order;
+
+    int home;
+
+    int elements = init_elements, warriors = 0, index = 0, elements_buffer = 0;
+
+    Roster pWarriors;
+
+    // A side's warriors all advance together, so a warrior's distance from home is the number of marches
+    // since its birth. Those still on the way sit in lane, indexed by birth step; the one at the enemy
+    // headquarter is held apart in stopped.
+    int steps = 0;
+
+    std::vector<Warrior *> lane;
+
+    Warrior *stopped = nullptr, *resting = nullptr;
+
+    Warrior *&lane_slot(const int &birth) { return lane[birth % lane.size()]; }
+
+    Warrior *occupant(const int &distance)
+    {
+        if (distance == nCities + 1)
+        {
+            return stopped;
+        }
+        return steps >= distance ? lane_slot(steps - distance) : nullptr;
+    }
+
+    void enlist(Warrior *warrior)
+    {
+        warrior->birth = steps;
+        lane_slot(steps) = warrior;
+    }
+
+    void vacate(Warrior *warrior)
+    {
+        if (stopped == warrior)
+        {
+            stopped = nullptr;
+        }
+        else if (lane_slot(warrior->birth) == warrior)
+        {
+            lane_slot(warrior->birth) = nullptr;
+        }
+        if (resting == warrior)
+        {
+            resting = nullptr;
+        }
+    }
+
+public:
+    static Headquarter *sides[2];
+
+    Headquarter(const city_type &_type) : type(_type), lane(nCities + 2, nullptr)
+    {
+        memory.add(memory.lane_slots, lane.capacity(), sizeof(Warrior *));
+        order = produce_order[type];
+        home = type == red ? 0 : nCities + 1;
+        if (holds_city(home))
+        {
+            city_at(home)->flag = type;
+        }
+        sides[type] = this;
+    }
+
+    ~Headquarter()
+    {
+        // Each delete leaves the roster, which may squeeze it, so always take the first.
+        while (!pWarriors.empty())
+        {
+            delete *pWarriors.begin();
+        }
+        memory.remove(memory.lane_slots, lane.capacity(), sizeof(Warrior *));
+    }
+
+    // Pays for the next warrior in the production order; returns its type, or -1 if it cannot be afforded.
+    int recruit()
+    {
+        warrior_type _type = order[index];
+        int cost = Warrior::elements_value[_type];
+        if (elements < cost)
+        {
+            return -1;
         }
         elements -= cost, ++warriors;
         index = ++index % nWarriors;
+        return _type;
+    }
+
+    void create(const warrior_type &_type, const int &id)
+    {
         switch (_type)
         {
         case dragon:
-            pWarriors.emplace(warriors, new Dragon(this, warriors, 1.0 * elements / cost));
+            pWarriors.push(new Dragon(this, id, 1.0 * elements / Warrior::elements_value[dragon]));
             break;
 
         case ninja:
-            pWarriors.emplace(warriors, new Ninja(this, warriors));
+            pWarriors.push(new Ninja(this, id));
             break;
         case iceman:
-            pWarriors.emplace(warriors, new Iceman(this, warriors));
+            pWarriors.push(new Iceman(this, id));
             break;
         case lion:
-            pWarriors.emplace(warriors, new Lion(this, warriors, elements));
+            pWarriors.push(new Lion(this, id, elements));
             break;
         case wolf:
-            pWarriors.emplace(warriors, new Wolf(this, warriors));
+            pWarriors.push(new Wolf(this, id));
+        }
+    }
+
+    void produce()
+    {
+        int _type = recruit();
+        if (_type >= 0)
+        {
+            create(warrior_type(_type), warriors);
+        }
+    }
+
+    // Takes in a warrior saved by another process; returns whether it reached the enemy headquarter while
+    // one of ours was already there.
+    bool adopt(Archive &in) { return adopt(Warrior::restore(this, in)); }
+
+    bool adopt(Warrior *warrior)
+    {
+        pWarriors.push(warrior);
+        if (steps - warrior->birth < nCities + 1)
+        {
+            lane_slot(warrior->birth) = warrior;
+            return 0;
+        }
+        bool conquer = stopped != nullptr;
+        stopped = warrior;
+        return conquer;
+    }
+
+    int army() { return pWarriors.size(); }
+
+    // Our warriors standing in a city with an enemy.
+    int contested()
+    {
+        int count = 0;
+        for (Warrior *warrior : pWarriors)
+        {
+            count += warrior->city()->warrior(type ^ 1) != nullptr;
+        }
+        return count;
+    }
+
+    // Writes the side between two hours, its warriors in id order.
+    void save(Archive &out)
+    {
+        out << elements << warriors << index << elements_buffer << steps << uint64_t(pWarriors.size());
+        for (Warrior *warrior : pWarriors)
+        {
+            warrior->save(out);
+        }
+    }
+
+    // Reads back what save() wrote into a headquarter with no warriors yet. Warriors must come in id order,
+    // each on a lane slot of its own or alone at the enemy headquarter.
+    void load(Archive &in)
+    {
+        uint64_t n;
+        in >> elements >> warriors >> index >> elements_buffer >> steps >> n;
+        if (elements < 0 || elements_buffer < 0 || warriors < 0 || index < 0 || index >= nWarriors || steps < 0 || n > uint64_t(warriors))
+        {
+            in.fail();
+        }
+        for (int last_id = 0; n-- && in.ok();)
+        {
+            Warrior *warrior = Warrior::restore(this, in);
+            int distance = warrior->birth < 0 ? -1 : steps - warrior->birth;
+            if (!in.ok() || warrior->id <= last_id || warrior->id > warriors || warrior->birth < 0 || distance < 0 || occupant(std::min(distance, nCities + 1)))
+            {
+                // Dropped with nothing to leave in a city and a birth that no lane slot holds it at.
+                in.fail();
+                warrior->discard_weapons(), warrior->birth = steps;
+                pWarriors.push(warrior);
+                delete warrior;
+                break;
+            }
+            last_id = warrior->id;
+            adopt(warrior);
         }
     }
 
+    // Hands a warrior over to another process: it leaves without dropping its weapons.
+    void release(Warrior *warrior, Archive &out)
+    {
+        warrior->save(out);
+        warrior->discard_weapons();
+        delete warrior;
+    }
+
     void report_elements()
     {
-        print_time();
-        std::cout << elements << " elements in " << headquarter_name[type] << " headquarter" << std::endl;
+        warcraft_event event = make_event(WARCRAFT_ELEMENTS);
+        event.side = type, event.value = elements;
+        emit(event);
     }
 
     void report_weapons()
     {
+        if (report_in_chunks(army()))
+        {
+            std::vector<Warrior *> snapshot;
+            snapshot.reserve(army());
+            if (type == blue)
+            {
+                for (Warrior *warrior : pWarriors)
+                {
+                    snapshot.push_back(warrior);
+                }
+            }
+            else
+            {
+                for (Warrior *warrior : pWarriors.reversed())
+                {
+                    snapshot.push_back(warrior);
+                }
+            }
+            print_weapons(snapshot);
+            return;
+        }
         if (type == blue)
         {
-            for (auto p = pWarriors.begin(); p != pWarriors.end(); ++p)
+            for (Warrior *warrior : pWarriors)
             {
-                p->second->report_weapons();
+                warrior->report_weapons();
             }
             return;
         }
-        for (auto p = pWarriors.rbegin(); p != pWarriors.rend(); ++p)
+        for (Warrior *warrior : pWarriors.reversed())
         {
-            p->second->report_weapons();
+            warrior->report_weapons();
         }
     }
 
+    // Moves every warrior on the way one city forward; only the one reaching the enemy headquarter is touched.
     bool march_and_if_conquer()
     {
-        bool conquer = 0;
-        for (auto p = pWarriors.begin(); p != pWarriors.end(); ++p)
+        resting = stopped;
+        int birth = steps++ - nCities;
+        if (birth < 0 || !lane_slot(birth))
         {
-            conquer |= p->second->march();
+            return 0;
         }
+        bool conquer = stopped != nullptr;
+        stopped = lane_slot(birth), lane_slot(birth) = nullptr;
         return conquer;
     }
 
-    void award_elements()
+    int count_winners()
+    {
+        int count = 0;
+        for (Warrior *warrior : pWarriors)
+        {
+            count += warrior->city()->curr_win == type;
+        }
+        return count;
+    }
+
+    // Awards the first quota warriors, in id order, that won their battle this hour; returns how many got one.
+    int award(const int &quota)
     {
-        for (auto p = pWarriors.begin(); p != pWarriors.end(); ++p)
+        int awarded = 0;
+        for (Warrior *warrior : pWarriors)
         {
-            if (elements < win_award)
+            if (awarded == quota)
             {
                 break;
             }
-            if (p->second->pCity->curr_win == type)
+            if (warrior->city()->curr_win == type)
             {
-                p->second->gain_elements(win_award), elements -= win_award;
-                p->second->refresh_record_elements();
+                warrior->gain_elements(win_award), ++awarded;
+                warrior->refresh_record_elements();
             }
         }
+        return awarded;
+    }
+
+    void award_elements()
+    {
+        elements -= win_award * award(elements / win_award);
         elements += elements_buffer, elements_buffer = 0;
     }
 
     void report_conquer()
     {
-        print_time();
-        std::cout << headquarter_name[type ^ 1] << " headquarter was taken" << std::endl;
+        stats.conquest[type] = 60 * hour + minute;
+        warcraft_event event = make_event(WARCRAFT_TAKEN);
+        event.side = type ^ 1;
+        emit(event);
     }
 
     friend class Warrior;
 
     friend class City;
+
+    friend class Shard;
+
+    friend class ShardedEngine;
+
+    friend class Stats;
+
+    friend void print_warrior(std::ostream &out, const warcraft_warrior &warrior);
+
+    friend void print_event(std::ostream &out, const warcraft_event &event);
+
+    friend void format_weapons(LineWriter &line, const warcraft_event &event);
+
+    friend class SparseEngine;
+
+    friend struct Bench;
 };
 
 std::string Warrior::warrior_name[nWarriors] = {"dragon", "ninja", "iceman", "lion", "wolf"};
@@ -731,21 +1486,22 @@ int Warrior::elements_value[nWarriors], Warrior::force_value[nWarriors];
 
 int City::count = -1;
 
+Headquarter *Headquarter::sides[2];
+
 std::string Headquarter::headquarter_name[2] = {"red", "blue"};
 
 warrior_type Headquarter::produce_order[2][nWarriors] = {{iceman, lion, wolf, ninja, dragon}, {lion, dragon, ninja, iceman, wolf}};
 
 Warrior::Warrior(Headquarter *headquarter, const int &_id, const warrior_type &_type) : pHeadquarter(headquarter), type(_type), id(_id)
 {
+    memory.add(memory.warriors[type], 1, Memory::warrior_size[type]);
     elements = elements_value[type], force = force_value[type];
-    pCity = pHeadquarter->pCity;
-    pCity->pWarriors[pHeadquarter->type] = this;
+    pHeadquarter->enlist(this);
     for (int i = 0; i < nWeapons; ++i)
     {
         pWeapons[i] = nullptr;
     }
-    print_time(), print_self();
-    std::cout << " born" << std::endl;
+    emit(describe(WARCRAFT_BORN));
 }
 
 Warrior::~Warrior()
@@ -754,19 +1510,27 @@ Warrior::~Warrior()
     {
         if (pWeapons[i])
         {
-            pCity->weapon_pool.emplace(weapon_type(i), pWeapons[i]);
+            if (city()->weapon_pool.emplace(weapon_type(i), pWeapons[i]).second)
+            {
+                memory.add(memory.pool_nodes, 1, Memory::pool_node_size);
+            }
+            else
+            {
+                delete pWeapons[i];
+            }
             pWeapons[i] = nullptr;
         }
     }
-    pCity->pWarriors[pHeadquarter->type] = nullptr;
-    pHeadquarter->pWarriors.erase(id);
+    pHeadquarter->vacate(this);
+    pHeadquarter->pWarriors.remove(this);
+    memory.remove(memory.warriors[type], 1, Memory::warrior_size[type]);
 }
 
-void Warrior::print_self() { std::cout << Headquarter::headquarter_name[pHeadquarter->type] << ' ' << warrior_name[type] << ' ' << id; }
+warcraft_warrior Warrior::who() { return {pHeadquarter->type, type, id}; }
 
 void Warrior::pick_weapon()
 {
-    std::map<weapon_type, Weapon *> &pool = pCity->weapon_pool;
+    std::map<weapon_type, Weapon *> &pool = city()->weapon_pool;
     for (int i = 0; i < nWeapons; ++i)
     {
         if (pWeapons[i])
@@ -778,6 +1542,7 @@ void Warrior::pick_weapon()
         {
             pWeapons[i] = weapon->second;
             pool.erase(weapon_type(i));
+            memory.remove(memory.pool_nodes, 1, Memory::pool_node_size);
         }
     }
 }
@@ -806,10 +1571,10 @@ bool Warrior::try_to_use_bomb(Warrior *enemy, const city_type &active)
         enemy->elements = elements = 0;
         pWeapons[bomb]->utilize();
         try_to_destroy_weapon(bomb);
-        print_time(), print_self();
-        std::cout << " used a bomb and killed ";
-        enemy->print_self();
-        std::cout << std::endl;
+        stats.kill(type, enemy->type), ++stats.deaths[type], ++stats.bombs;
+        warcraft_event event = describe(WARCRAFT_BOMB);
+        event.object = enemy->who();
+        emit(event);
         return 1;
     }
     return 0;
@@ -825,15 +1590,12 @@ void Warrior::actively_attack(Warrior *enemy)
         try_to_destroy_weapon(sword);
     }
     enemy->hurted(attack_value);
-    print_time(), print_self();
-    std::cout << " attacked ";
-    enemy->print_self();
-    std::cout << " in ";
-    pCity->print_self();
-    std::cout << " with " << elements << " elements and force " << force << std::endl;
+    warcraft_event event = describe(WARCRAFT_ATTACKED);
+    event.object = enemy->who(), event.city = position(), event.value = elements, event.force = force;
+    emit(event);
     if (enemy->is_dead())
     {
-        enemy->report_death();
+        enemy->report_death(this);
     }
 }
 
@@ -847,69 +1609,57 @@ void Warrior::passively_attack(Warrior *enemy)
         try_to_destroy_weapon(sword);
     }
     enemy->hurted(attack_value);
-    print_time(), print_self();
-    std::cout << " fought back against ";
-    enemy->print_self();
-    std::cout << " in ";
-    pCity->print_self();
-    std::cout << std::endl;
+    warcraft_event event = describe(WARCRAFT_FOUGHT_BACK);
+    event.object = enemy->who(), event.city = position();
+    emit(event);
     if (enemy->is_dead())
     {
-        enemy->report_death();
+        enemy->report_death(this);
     }
 }
 
 void Warrior::send_elements_to_headquarter(const int &value)
 {
-    pHeadquarter->elements_buffer += value;
-    print_time(), print_self();
-    std::cout << " earned " << value << " elements for his headquarter" << std::endl;
+    pHeadquarter->elements_buffer += value, stats.income[pHeadquarter->type] += value;
+    warcraft_event event = describe(WARCRAFT_EARNED);
+    event.value = value;
+    emit(event);
 }
 
-void Warrior::report_death()
+void Warrior::report_death(Warrior *killer)
 {
-    print_time(), print_self();
-    std::cout << " was killed in ";
-    pCity->print_self();
-    std::cout << std::endl;
+    stats.kill(killer->type, type);
+    warcraft_event event = describe(WARCRAFT_KILLED);
+    event.city = position();
+    emit(event);
 }
 
-bool Warrior::march()
+void Warrior::report_arrival()
 {
-    if (is_at_target_city())
-    {
-        return 0;
-    }
-    move = 1;
-    during_march();
-    city_type _type = pHeadquarter->type;
-    pCity->pWarriors[_type] = nullptr;
-    pCity += (_type == red ? 1 : -1);
-    bool conquer = pCity->pWarriors[_type];
-    pCity->pWarriors[_type] = this;
-    return conquer;
+    warcraft_event event = describe(is_at_target_city() ? WARCRAFT_REACHED : WARCRAFT_MARCHED);
+    event.city = position(), event.value = elements, event.force = force;
+    emit(event);
 }
 
-void Warrior::report_arrival()
+bool Warrior::is_at_target_city() { return pHeadquarter->steps - birth >= nCities + 1; }
+
+bool Warrior::is_at_home() { return pHeadquarter->steps == birth; }
+
+int Warrior::position() { return city()->index; }
+
+City *Warrior::city()
 {
-    move = 0, print_time(), print_self();
-    if (is_at_target_city())
-    {
-        std::cout << " reached " << Headquarter::headquarter_name[pHeadquarter->type ^ 1] << " headquarter";
-    }
-    else
-    {
-        std::cout << " marched to ";
-        pCity->print_self();
-    }
-    std::cout << " with " << elements << " elements and force " << force << std::endl;
+    int distance = std::min(pHeadquarter->steps - birth, nCities + 1);
+    return city_at(pHeadquarter->home + (pHeadquarter->type == red ? distance : -distance));
 }
 
-bool Warrior::is_at_target_city() { return pCity->index == nCities + 1 - pHeadquarter->pCity->index; }
-
-bool Warrior::is_at_home() { return pCity == pHeadquarter->pCity; }
+bool Warrior::has_marched() { return this != pHeadquarter->resting; }
 
-int Warrior::position() { return pCity->index; }
+Warrior *City::warrior(const int &side)
+{
+    Headquarter *headquarter = Headquarter::sides[side];
+    return headquarter->occupant(std::abs(index - headquarter->home));
+}
 
 void Dragon::after_attack(Warrior *enemy, const Result &result)
 {
@@ -924,10 +1674,10 @@ void Dragon::after_attack(Warrior *enemy, const Result &result)
     }
     if (morale > 0.8)
     {
-        print_time(), print_self();
-        std::cout << " yelled in ";
-        pCity->print_self();
-        std::cout << std::endl;
+        ++stats.dragon_yells;
+        warcraft_event event = describe(WARCRAFT_YELLED);
+        event.city = position();
+        emit(event);
     }
 }
 
@@ -935,16 +1685,17 @@ void City::raise_flag()
 {
     for (int i = 0; i < 2; ++i)
     {
-        if (pWarriors[i] && pWarriors[i]->is_dead())
+        Warrior *loser = warrior(i);
+        if (loser && loser->is_dead())
         {
-            delete pWarriors[i];
+            delete loser;
         }
     }
     for (int i = 0; i < 2; ++i)
     {
-        if (pWarriors[i])
+        if (Warrior *survivor = warrior(i))
         {
-            pWarriors[i]->pick_weapon();
+            survivor->pick_weapon();
         }
     }
     clear_weapons(), warrior_earn_elements();
@@ -952,131 +1703,2414 @@ void City::raise_flag()
     {
         return;
     }
-    flag = prev_win;
-    print_time();
-    std::cout << Headquarter::headquarter_name[flag] << " flag raised in ";
-    print_self();
-    std::cout << std::endl;
+    flag = prev_win, ++stats.flags[index];
+    warcraft_event event = make_event(WARCRAFT_FLAG);
+    event.side = flag, event.city = index;
+    emit(event);
 }
 
-bool for_all_cities(City *start, City *finish, void (*f)(City *), const int &time_increment = 0)
+void print_warrior(std::ostream &out, const warcraft_warrior &warrior) { out << Headquarter::headquarter_name[warrior.side] << ' ' << Warrior::warrior_name[warrior.type] << ' ' << warrior.id; }
+
+// The text line of an event, without the newline.
+void print_event(std::ostream &out, const warcraft_event &event)
 {
-    minute += time_increment;
-    if (time_not_valid())
+    switch (event.kind)
     {
-        return 1;
+    case WARCRAFT_MORALE:
+        out << "Its morale is " << std::fixed << std::setprecision(2) << event.morale;
+        return;
+    case WARCRAFT_LOYALTY:
+        out << "Its loyalty is " << event.value;
+        return;
+    case WARCRAFT_TAKEN:
+        print_time(out, event);
+        out << Headquarter::headquarter_name[event.side] << " headquarter was taken";
+        return;
+    case WARCRAFT_FLAG:
+        print_time(out, event);
+        out << Headquarter::headquarter_name[event.side] << " flag raised in city " << event.city;
+        return;
+    case WARCRAFT_ELEMENTS:
+        print_time(out, event);
+        out << event.value << " elements in " << Headquarter::headquarter_name[event.side] << " headquarter";
+        return;
     }
-    for (; start != finish; ++start)
+    print_time(out, event), print_warrior(out, event.subject);
+    switch (event.kind)
     {
-        f(start);
+    case WARCRAFT_BORN:
+        out << " born";
+        break;
+    case WARCRAFT_RAN_AWAY:
+        out << " ran away";
+        break;
+    case WARCRAFT_MARCHED:
+        out << " marched to city " << event.city << " with " << event.value << " elements and force " << event.force;
+        break;
+    case WARCRAFT_REACHED:
+        out << " reached " << Headquarter::headquarter_name[event.subject.side ^ 1] << " headquarter with " << event.value << " elements and force " << event.force;
+        break;
+    case WARCRAFT_EARNED:
+        out << " earned " << event.value << " elements for his headquarter";
+        break;
+    case WARCRAFT_SHOT:
+        out << " shot";
+        if (event.value)
+        {
+            out << " and killed ", print_warrior(out, event.object);
+        }
+        break;
+    case WARCRAFT_BOMB:
+        out << " used a bomb and killed ", print_warrior(out, event.object);
+        break;
+    case WARCRAFT_ATTACKED:
+        out << " attacked ", print_warrior(out, event.object);
+        out << " in city " << event.city << " with " << event.value << " elements and force " << event.force;
+        break;
+    case WARCRAFT_FOUGHT_BACK:
+        out << " fought back against ", print_warrior(out, event.object);
+        out << " in city " << event.city;
+        break;
+    case WARCRAFT_KILLED:
+        out << " was killed in city " << event.city;
+        break;
+    case WARCRAFT_YELLED:
+        out << " yelled in city " << event.city;
+        break;
+    case WARCRAFT_WEAPONS:
+    {
+        const char *weapon_name[nWeapons] = {"sword", "bomb", "arrow"};
+        bool first_weapon = 1;
+        out << " has ";
+        for (int i = nWeapons - 1; i >= 0; --i)
+        {
+            if (event.weapons[i] < 0)
+            {
+                continue;
+            }
+            out << (first_weapon ? "" : ",") << weapon_name[i];
+            if (i != bomb)
+            {
+                out << '(' << event.weapons[i] << ')';
+            }
+            first_weapon = 0;
+        }
+        if (first_weapon)
+        {
+            out << "no weapon";
+        }
+        break;
+    }
     }
-    return 0;
 }
 
-inline void lion_escape_func(City *city) { city->lion_escape(); }
+// Spans and counters for --trace, in the Chrome trace JSON array format, whose closing bracket may be left
+// out so that every process can append its own records to the one file. Each process buffers its records
+// and writes them in whole records, and the buffer is written out before a fork.
+class Tracer
+{
+private:
+    int fd = -1;
 
-inline void produce_elements_func(City *city) { city->produce_elements(); }
+    std::string buffer;
 
-inline void earn_elements_func(City *city) { city->warrior_earn_elements(); }
+    void record(const char *phase, const std::string &name, const double &ts, const std::string &rest)
+    {
+        if (!enabled())
+        {
+            return;
+        }
+        std::ostringstream line;
+        line << std::fixed << std::setprecision(3) << "{\"name\":\"" << name << "\",\"ph\":\"" << phase << "\",\"ts\":" << ts << ",\"pid\":" << getpid() << ",\"tid\":" << getpid() << rest << "},\n";
+        buffer += line.str();
+        if (buffer.size() >= (1 << 20))
+        {
+            flush();
+        }
+    }
 
-inline void shot_func(City *city) { city->warrior_shot(); }
+public:
+    // Bytes of output lines formatted by this process.
+    long long bytes = 0;
 
-inline void explode_func(City *city) { city->warrior_explode(); }
+    bool enabled() { return fd >= 0; }
 
-inline void fight_func(City *city) { city->warrior_fight(); }
+    bool open(const char *path)
+    {
+        fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+        buffer = "[\n";
+        return fd >= 0;
+    }
 
-inline void reset_record_func(City *city) { city->reset_record(); }
+    // Microseconds on the clock shared by all processes.
+    static double now() { return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now().time_since_epoch()).count(); }
 
-int main()
-{
-    freopen("data.in", "r", stdin);
-    freopen("WarCraft.out", "w", stdout);
-    int cases;
-    std::cin >> cases;
-    for (int k = 1; k <= cases; ++k)
+    // A span from start until now; args is a JSON object or empty.
+    void span(const std::string &name, const double &start, const std::string &args = "")
     {
-        hour = minute = 0;
-        std::cin >> init_elements >> nCities >> arrow_attack >> loyalty_decrease >> time_limit;
-        for (int i = 0; i < nWarriors; ++i)
+        double end = now();
+        std::ostringstream rest;
+        rest << std::fixed << std::setprecision(3) << ",\"dur\":" << end - start;
+        if (!args.empty())
         {
-            std::cin >> Warrior::elements_value[i];
+            rest << ",\"args\":" << args;
         }
-        for (int i = 0; i < nWarriors; ++i)
+        record("X", name, start, rest.str());
+    }
+
+    void counter(const std::string &name, const std::string &values) { record("C", name, now(), ",\"args\":" + values); }
+
+    void name_process(const std::string &name) { record("M", "process_name", 0, ",\"args\":{\"name\":\"" + name + "\"}"); }
+
+    // The live warriors of each side and the cities where they meet, from this process's headquarters.
+    void count_armies()
+    {
+        Headquarter *Red = Headquarter::sides[red], *Blue = Headquarter::sides[blue];
+        counter("warriors", "{\"red\":" + std::to_string(Red->army()) + ",\"blue\":" + std::to_string(Blue->army()) + '}');
+        counter("contested cities", "{\"cities\":" + std::to_string(Red->contested()) + '}');
+        counter("bytes written", "{\"bytes\":" + std::to_string(bytes) + '}');
+    }
+
+    void flush()
+    {
+        if (enabled() && !buffer.empty())
         {
-            std::cin >> Warrior::force_value[i];
+            write(fd, buffer.data(), buffer.size());
         }
-        std::cout << "Case " << k << ':' << std::endl;
+        buffer.clear();
+    }
+} tracer;
 
-        City *city = new City[nCities + 2], *start = city, *finish = city + nCities + 2;
-        Headquarter Red(start, red), Blue(finish - 1, blue);
+// Times the rest of its scope as a span.
+class Span
+{
+private:
+    const char *name;
+
+    double start;
+
+public:
+    Span(const char *_name) : name(_name), start(tracer.enabled() ? Tracer::now() : 0) {}
 
-        while (!time_not_valid())
+    ~Span()
+    {
+        if (tracer.enabled())
         {
-            Red.produce(), Blue.produce();
-            if (for_all_cities(start, finish, lion_escape_func, 5))
-            {
-                break;
-            }
-            minute += 5;
-            if (time_not_valid())
-            {
-                break;
-            }
-            bool red_victory = Red.march_and_if_conquer(), blue_victory = Blue.march_and_if_conquer();
-            for (City *i = start; i < finish; ++i)
-            {
-                i->warrior_arrive();
-                if (i == start && blue_victory)
-                {
-                    Blue.report_conquer();
-                }
-                if (i == finish - 1 && red_victory)
-                {
-                    Red.report_conquer();
-                }
-            }
-            if (red_victory || blue_victory)
-            {
-                break;
-            }
-            if (for_all_cities(start + 1, finish - 1, produce_elements_func, 10))
-            {
-                break;
-            }
-            if (for_all_cities(start + 1, finish - 1, earn_elements_func, 10))
+            tracer.span(name, start);
+        }
+    }
+};
+
+// Where events go when a library caller runs a case; otherwise they are printed.
+warcraft_callback event_callback = nullptr;
+
+void *event_context = nullptr;
+
+void append_event(const warcraft_event *event, void *context) { static_cast<std::vector<warcraft_event> *>(context)->push_back(*event); }
+
+void emit(const warcraft_event &event)
+{
+    if (event_callback)
+    {
+        event_callback(&event, event_context);
+        return;
+    }
+    if (tracer.enabled())
+    {
+        std::ostringstream line;
+        print_event(line, event);
+        tracer.bytes += line.str().size() + 1;
+        std::cout << line.str() << std::endl;
+        return;
+    }
+    print_event(std::cout, event);
+    std::cout << std::endl;
+}
+
+// Report phases of at least this many lines are cut into chunks of at least this many lines, formatted by
+// report_threads threads, or one per core if 0.
+const int report_chunk_lines = 2048;
+
+int report_threads = 0;
+
+bool report_in_chunks(const int &lines) { return !event_callback && lines >= report_chunk_lines; }
+
+// Writes text at out, or only counts its length if out is null.
+class LineWriter
+{
+public:
+    char *out;
+
+    size_t size = 0;
+
+    LineWriter(char *_out) : out(_out) {}
+
+    void text(const char *data, const size_t &length)
+    {
+        if (out)
+        {
+            memcpy(out + size, data, length);
+        }
+        size += length;
+    }
+
+    void text(const std::string &data) { text(data.data(), data.size()); }
+
+    void text(const char &c) { text(&c, 1); }
+
+    // A number padded with zeros to width, as with std::setfill('0').
+    void number(const int &value, const int &width = 0)
+    {
+        char digits[16];
+        int length = 0;
+        unsigned magnitude = value < 0 ? 0u - unsigned(value) : unsigned(value);
+        do
+        {
+            digits[length++] = '0' + magnitude % 10;
+        } while (magnitude /= 10);
+        if (value < 0)
+        {
+            digits[length++] = '-';
+        }
+        while (length < width)
+        {
+            digits[length++] = '0';
+        }
+        std::reverse(digits, digits + length);
+        text(digits, length);
+    }
+};
+
+// The line of a WARCRAFT_WEAPONS event and its newline, as print_event writes it.
+void format_weapons(LineWriter &line, const warcraft_event &event)
+{
+    static const char *weapon_name[nWeapons] = {"sword", "bomb", "arrow"};
+    line.number(event.hour, 3), line.text(':'), line.number(event.minute, 2), line.text(' ');
+    line.text(Headquarter::headquarter_name[event.subject.side]), line.text(' ');
+    line.text(Warrior::warrior_name[event.subject.type]), line.text(' ');
+    line.number(event.subject.id), line.text(" has ", 5);
+    bool first_weapon = 1;
+    for (int i = nWeapons - 1; i >= 0; --i)
+    {
+        if (event.weapons[i] < 0)
+        {
+            continue;
+        }
+        if (!first_weapon)
+        {
+            line.text(',');
+        }
+        line.text(weapon_name[i], strlen(weapon_name[i]));
+        if (i != bomb)
+        {
+            line.text('('), line.number(event.weapons[i]), line.text(')');
+        }
+        first_weapon = 0;
+    }
+    if (first_weapon)
+    {
+        line.text("no weapon", 9);
+    }
+    line.text('\n');
+}
+
+// Runs f(c) for every chunk c, chunk 0 on this thread and the others each on a thread of its own.
+template <class F>
+void for_each_chunk(const size_t &chunks, F f)
+{
+    std::vector<std::future<void>> running;
+    for (size_t c = 1; c < chunks; ++c)
+    {
+        running.push_back(std::async(std::launch::async, f, c));
+    }
+    f(0);
+    for (std::future<void> &chunk : running)
+    {
+        chunk.get();
+    }
+}
+
+// Every chunk first measures its lines; then, from the offsets those lengths give, the chunks write their
+// lines side by side into one buffer, which is printed at once.
+void print_weapons(const std::vector<Warrior *> &warriors)
+{
+    size_t threads = report_threads ? report_threads : std::max(1u, std::thread::hardware_concurrency());
+    size_t chunks = std::max<size_t>(1, std::min(threads, warriors.size() / report_chunk_lines));
+    std::vector<size_t> offset(chunks + 1, 0);
+    auto lines = [&](const size_t &c, LineWriter &line) {
+        for (size_t i = warriors.size() * c / chunks, end = warriors.size() * (c + 1) / chunks; i < end; ++i)
+        {
+            format_weapons(line, warriors[i]->weapons_event());
+        }
+    };
+    for_each_chunk(chunks, [&](size_t c) {
+        LineWriter line(nullptr);
+        lines(c, line);
+        offset[c + 1] = line.size;
+    });
+    std::partial_sum(offset.begin(), offset.end(), offset.begin());
+    std::string text(offset[chunks], '\0');
+    for_each_chunk(chunks, [&](size_t c) {
+        LineWriter line(&text[0] + offset[c]);
+        lines(c, line);
+    });
+    tracer.bytes += text.size();
+    std::cout.write(text.data(), text.size()) << std::flush;
+}
+
+void for_all_cities(City *start, City *finish, void (*f)(City *))
+{
+    for (; start != finish; ++start)
+    {
+        f(start);
+    }
+}
+
+inline void lion_escape_func(City *city) { city->lion_escape(); }
+
+inline void produce_elements_func(City *city) { city->produce_elements(); }
+
+inline void earn_elements_func(City *city) { city->warrior_earn_elements(); }
+
+inline void shot_func(City *city) { city->warrior_shot(); }
+
+inline void explode_func(City *city) { city->warrior_explode(); }
+
+inline void fight_func(City *city) { city->warrior_fight(); }
+
+inline void reset_record_func(City *city) { city->reset_record(); }
+
+const char *engine_version = "WarCraft-v4.2";
+
+const char *base64_digits = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+std::string to_base64(const std::string &in)
+{
+    std::string out;
+    out.reserve((in.size() + 2) / 3 * 4);
+    for (size_t i = 0; i < in.size(); i += 3)
+    {
+        uint32_t group = uint32_t((unsigned char)in[i]) << 16;
+        if (i + 1 < in.size())
+        {
+            group |= uint32_t((unsigned char)in[i + 1]) << 8;
+        }
+        if (i + 2 < in.size())
+        {
+            group |= (unsigned char)in[i + 2];
+        }
+        for (int j = 0; j < 4; ++j)
+        {
+            out += i + j <= in.size() ? base64_digits[(group >> (18 - 6 * j)) & 63] : '=';
+        }
+    }
+    return out;
+}
+
+bool from_base64(const std::string &in, std::string &out)
+{
+    if (in.size() % 4)
+    {
+        return 0;
+    }
+    out.clear(), out.reserve(in.size() / 4 * 3);
+    for (size_t i = 0; i < in.size(); i += 4)
+    {
+        uint32_t group = 0;
+        int padding = 0;
+        for (int j = 0; j < 4; ++j)
+        {
+            char c = in[i + j];
+            const char *digit = c ? strchr(base64_digits, c) : nullptr;
+            if (c == '=' && i + 4 == in.size() && j >= 2)
             {
-                break;
+                ++padding, group <<= 6;
+                continue;
             }
-            if (for_all_cities(start, finish, shot_func, 5))
+            if (!digit || padding)
             {
-                break;
+                return 0;
             }
-            if (for_all_cities(start, finish, explode_func, 3))
+            group = group << 6 | (digit - base64_digits);
+        }
+        for (int j = 0; j < 3 - padding; ++j)
+        {
+            out += char(group >> (16 - 8 * j));
+        }
+    }
+    return 1;
+}
+
+// The options given to warcraft_setup().
+int shard_count = 0;
+
+std::string engine_name = "fused";
+
+// The live bytes at which a case is stopped, or 0.
+long long memory_limit = 0;
+
+// Where keyframes are written and how many hours apart.
+std::string keyframe_directory;
+
+int keyframe_every = 100;
+
+// The wall-clock milliseconds a case runs before it is suspended, or 0.
+long long budget_ms = 0;
+
+// Sets up the rules of a case and rewinds the clock; returns 0 if the map cannot be built.
+bool configure(const warcraft_config &config)
+{
+    if (config.cities < 0 || config.cities > INT32_MAX - 2)
+    {
+        return 0;
+    }
+    init_elements = config.elements, nCities = config.cities, arrow_attack = config.arrow_attack;
+    loyalty_decrease = config.loyalty_decrease, time_limit = config.time_limit;
+    for (int i = 0; i < nWarriors; ++i)
+    {
+        Warrior::elements_value[i] = config.warrior_elements[i], Warrior::force_value[i] = config.warrior_force[i];
+    }
+    hour = minute = 0;
+    return 1;
+}
+
+bool open_snapshot(const std::string &data, Archive &in);
+
+// A case read from a continuation token, with the clock set by open_snapshot() and the rest left in
+// resume_state for the engine.
+Archive resume_state;
+
+bool resuming = 0;
+
+// One way of carrying out the phases of an hour; simulate() keeps the clock and calls them in order.
+class Engine
+{
+public:
+    virtual ~Engine() {}
+
+    virtual void produce() = 0;
+
+    virtual void lion_escape() = 0;
+
+    // Marches both armies and reports the arrivals; returns whether a headquarter was taken.
+    virtual bool march() = 0;
+
+    virtual void produce_elements() = 0;
+
+    virtual void earn_elements() = 0;
+
+    virtual void shot() = 0;
+
+    virtual void explode() = 0;
+
+    virtual void fight() = 0;
+
+    // Awards the winners of this hour's battles and clears the battle records.
+    virtual void award() = 0;
+
+    virtual void report_elements() = 0;
+
+    virtual void report_weapons() = 0;
+
+    // Writes the map between two hours, or reads it back into a newly built engine; returns 0 if the
+    // engine cannot.
+    virtual bool save(Archive &) { return 0; }
+
+    virtual bool load(Archive &) { return 0; }
+};
+
+// The whole map in this process, one pass over the cities per phase.
+class SerialEngine : public Engine
+{
+protected:
+    City *start, *finish;
+
+    Headquarter *Red, *Blue;
+
+public:
+    SerialEngine()
+    {
+        cities = City::build(0, nCities + 2), first_city = 0, held_cities = nCities + 2;
+        start = cities, finish = cities + held_cities;
+        Red = new Headquarter(red), Blue = new Headquarter(blue);
+    }
+
+    ~SerialEngine()
+    {
+        delete Red, delete Blue;
+        delete[] cities;
+        cities = nullptr, held_cities = 0;
+    }
+
+    void produce() override { Red->produce(), Blue->produce(); }
+
+    void lion_escape() override { for_all_cities(start, finish, lion_escape_func); }
+
+    bool march() override
+    {
+        bool red_victory = Red->march_and_if_conquer(), blue_victory = Blue->march_and_if_conquer();
+        for (City *i = start; i < finish; ++i)
+        {
+            i->warrior_arrive();
+            if (i == start && blue_victory)
             {
-                break;
+                Blue->report_conquer();
             }
-            if (for_all_cities(start, finish, fight_func, 2))
+            if (i == finish - 1 && red_victory)
             {
-                break;
+                Red->report_conquer();
             }
-            Red.award_elements(), Blue.award_elements();
-            for_all_cities(start, finish, reset_record_func);
-            minute += 10;
-            if (time_not_valid())
+        }
+        return red_victory || blue_victory;
+    }
+
+    void produce_elements() override { for_all_cities(start + 1, finish - 1, produce_elements_func); }
+
+    void earn_elements() override { for_all_cities(start + 1, finish - 1, earn_elements_func); }
+
+    void shot() override { for_all_cities(start, finish, shot_func); }
+
+    void explode() override { for_all_cities(start, finish, explode_func); }
+
+    void fight() override { for_all_cities(start, finish, fight_func); }
+
+    void award() override
+    {
+        Red->award_elements(), Blue->award_elements();
+        for_all_cities(start, finish, reset_record_func);
+    }
+
+    void report_elements() override { Red->report_elements(), Blue->report_elements(); }
+
+    void report_weapons() override { Red->report_weapons(), Blue->report_weapons(); }
+
+    bool save(Archive &out) override
+    {
+        Red->save(out), Blue->save(out);
+        for (City *i = start; i < finish; ++i)
+        {
+            i->save(out);
+        }
+        return 1;
+    }
+
+    bool load(Archive &in) override
+    {
+        Red->load(in), Blue->load(in);
+        for (City *i = start; i < finish && in.ok(); ++i)
+        {
+            i->load(in);
+        }
+        return in.ok();
+    }
+};
+
+// SerialEngine with the city-local phases fused into two sweeps, so that each city is loaded once per group:
+// elements are produced and collected in the same pass, and shots, explosions and fights run together with the
+// explosions and fights trailing one city behind, since a shot reaches the next city and its report is printed there.
+// Each phase of the second sweep collects its events apart so that they go out in phase order.
+class FusedEngine : public SerialEngine
+{
+private:
+    std::vector<warcraft_event> shots, explosions, fights;
+
+    // Whether this hour's clock gets to the given minute.
+    static bool reaches(const int &minutes) { return 60 * hour + minutes <= time_limit; }
+
+    static void flush(std::vector<warcraft_event> &events)
+    {
+        for (const warcraft_event &event : events)
+        {
+            emit(event);
+        }
+        events.clear();
+    }
+
+public:
+    // Done in earn_elements(); if the clock stops before then, nobody sees the produced elements.
+    void produce_elements() override {}
+
+    void earn_elements() override
+    {
+        for (City *i = start + 1; i < finish - 1; ++i)
+        {
+            i->produce_elements();
+            i->warrior_earn_elements();
+        }
+    }
+
+    void shot() override
+    {
+        if (!reaches(40))
+        {
+            SerialEngine::shot();
+        }
+    }
+
+    void explode() override
+    {
+        if (!reaches(40))
+        {
+            SerialEngine::explode();
+        }
+    }
+
+    // Last hour's battle records are cleared here, just before each city fights again.
+    void fight() override
+    {
+        warcraft_callback callback = event_callback;
+        void *context = event_context;
+        event_callback = append_event;
+        for (City *i = start; i <= finish; ++i)
+        {
+            if (i != finish)
             {
-                break;
+                event_context = &shots, minute = 35;
+                i->warrior_shot();
             }
-            Red.report_elements(), Blue.report_elements();
-            minute += 5;
-            if (time_not_valid())
+            if (i != start)
             {
-                break;
+                City *behind = i - 1;
+                event_context = &explosions, minute = 38;
+                behind->warrior_explode();
+                event_context = &fights, minute = 40;
+                behind->reset_record();
+                behind->warrior_fight();
             }
-            Red.report_weapons(), Blue.report_weapons();
-            ++hour, minute = 0;
         }
+        event_callback = callback, event_context = context;
+        flush(shots), flush(explosions), flush(fights);
+    }
+
+    void award() override { Red->award_elements(), Blue->award_elements(); }
+};
+
+// SerialEngine over the cities that hold a warrior, found from the two rosters in O(warriors) each hour.
+// A city nobody stands in changes only by the 10 elements it produces every hour, so production is
+// counted once per hour and paid out to a city when a phase next visits it; the rest of the map is not
+// touched for as many hours as it stays empty. Fights also visit the cities left this hour, where an
+// escaped lion may have dropped weapons.
+class SparseEngine : public SerialEngine
+{
+private:
+    // Hours of production so far, and up to which of them each city has been paid.
+    int produced = 0;
+
+    std::vector<int> paid;
+
+    // Occupied cities in index order before and after the march, and both together for the fights.
+    std::vector<City *> before, after, visited, red_cities, blue_cities;
 
-        delete[] city;
+    void settle(City *city)
+    {
+        if (city == start || city == finish - 1)
+        {
+            return;
+        }
+        int &last = paid[city - start];
+        city->elements += 10 * (produced - last), last = produced;
     }
-    return 0;
-}
\ No newline at end of file
+
+    // The cities holding a warrior, with both headquarters, in index order.
+    void occupied(std::vector<City *> &list)
+    {
+        red_cities.clear(), blue_cities.clear(), list.clear();
+        red_cities.push_back(start);
+        for (Warrior *warrior : Red->pWarriors)
+        {
+            red_cities.push_back(warrior->city());
+        }
+        std::reverse(red_cities.begin() + 1, red_cities.end());
+        for (Warrior *warrior : Blue->pWarriors)
+        {
+            blue_cities.push_back(warrior->city());
+        }
+        blue_cities.push_back(finish - 1);
+        std::merge(red_cities.begin(), red_cities.end(), blue_cities.begin(), blue_cities.end(), std::back_inserter(list));
+        list.erase(std::unique(list.begin(), list.end()), list.end());
+    }
+
+public:
+    SparseEngine() : paid(held_cities, 0) {}
+
+    void lion_escape() override
+    {
+        occupied(before);
+        for (City *city : before)
+        {
+            city->lion_escape();
+        }
+    }
+
+    bool march() override
+    {
+        bool red_victory = Red->march_and_if_conquer(), blue_victory = Blue->march_and_if_conquer();
+        occupied(after);
+        for (City *city : after)
+        {
+            city->warrior_arrive();
+            if (city == start && blue_victory)
+            {
+                Blue->report_conquer();
+            }
+            if (city == finish - 1 && red_victory)
+            {
+                Red->report_conquer();
+            }
+        }
+        return red_victory || blue_victory;
+    }
+
+    void produce_elements() override { ++produced; }
+
+    void earn_elements() override
+    {
+        for (City *city : after)
+        {
+            if (city != start && city != finish - 1)
+            {
+                settle(city);
+                city->warrior_earn_elements();
+            }
+        }
+    }
+
+    void shot() override
+    {
+        for (City *city : after)
+        {
+            city->warrior_shot();
+        }
+    }
+
+    void explode() override
+    {
+        for (City *city : after)
+        {
+            city->warrior_explode();
+        }
+    }
+
+    void fight() override
+    {
+        visited.clear();
+        std::merge(before.begin(), before.end(), after.begin(), after.end(), std::back_inserter(visited));
+        visited.erase(std::unique(visited.begin(), visited.end()), visited.end());
+        for (City *city : visited)
+        {
+            settle(city);
+            city->warrior_fight();
+        }
+    }
+
+    void award() override
+    {
+        Red->award_elements(), Blue->award_elements();
+        for (City *city : visited)
+        {
+            city->reset_record();
+        }
+    }
+
+    bool save(Archive &out) override
+    {
+        for (City *i = start; i < finish; ++i)
+        {
+            settle(i);
+        }
+        return SerialEngine::save(out);
+    }
+};
+
+// Builds the in-process engine called name; fused unless it is serial or sparse.
+Engine *make_engine(const std::string &name)
+{
+    if (name == "serial")
+    {
+        return new SerialEngine;
+    }
+    if (name == "sparse")
+    {
+        return new SparseEngine;
+    }
+    return new FusedEngine;
+}
+
+bool read_all(const int &fd, char *data, size_t size)
+{
+    while (size)
+    {
+        ssize_t got = read(fd, data, size);
+        if (got <= 0)
+        {
+            return 0;
+        }
+        data += got, size -= got;
+    }
+    return 1;
+}
+
+bool send_message(const int &fd, const Archive &message)
+{
+    uint64_t size = message.str().size();
+    return write_all(fd, reinterpret_cast<const char *>(&size), sizeof size) && write_all(fd, message.str().data(), size);
+}
+
+bool receive_message(const int &fd, Archive &message)
+{
+    uint64_t size;
+    if (!read_all(fd, reinterpret_cast<char *>(&size), sizeof size))
+    {
+        return 0;
+    }
+    std::string data(size, '\0');
+    if (!read_all(fd, &data[0], size))
+    {
+        return 0;
+    }
+    message = Archive(data);
+    return 1;
+}
+
+enum shard_command
+{
+    shard_begin,
+    shard_produce,
+    shard_escape,
+    shard_march_out,
+    shard_march_in,
+    shard_produce_elements,
+    shard_earn,
+    shard_shot_gather,
+    shard_shot_run,
+    shard_shot_finish,
+    shard_explode,
+    shard_fight,
+    shard_award_count,
+    shard_award,
+    shard_report_weapons,
+    shard_end
+};
+
+const char *shard_command_name[] = {"begin", "produce", "lion_escape", "march out", "march in", "produce_elements", "earn_elements", "shot gather", "shot", "shot finish", "explode", "fight", "award count", "award", "report_weapons", "end"};
+
+// A worker process owning the cities [lo, hi). It also holds city hi, if there is one, to stand a copy of
+// the blue warrior there while its red neighbour shoots at it.
+class Shard
+{
+private:
+    int lo, hi;
+
+    Headquarter *Red = nullptr, *Blue = nullptr;
+
+    bool red_victory, blue_victory;
+
+    // The shot phase is answered in two parts: its output waits here until the line about our first city's
+    // blue warrior comes back from the left neighbour.
+    std::string shot_output;
+
+    std::streampos shot_splice;
+
+    void for_owned(void (*f)(City *), const bool &inner = 0)
+    {
+        int first = inner ? std::max(lo, 1) : lo, last = inner ? std::min(hi, nCities + 1) : hi;
+        if (first < last)
+        {
+            for_all_cities(city_at(first), city_at(last), f);
+        }
+    }
+
+    Headquarter *side(const int &type) { return type == red ? Red : Blue; }
+
+    void begin(Archive &in)
+    {
+        in >> init_elements >> nCities >> arrow_attack >> loyalty_decrease >> time_limit;
+        for (int i = 0; i < nWarriors; ++i)
+        {
+            in >> Warrior::elements_value[i] >> Warrior::force_value[i];
+        }
+        in >> lo >> hi;
+        stats = Stats(), memory = Memory();
+        first_city = lo, held_cities = std::min(hi + 1, nCities + 2) - lo;
+        cities = City::build(first_city, held_cities);
+        Red = new Headquarter(red), Blue = new Headquarter(blue);
+    }
+
+    void end()
+    {
+        delete Red, delete Blue;
+        Red = Blue = nullptr;
+        delete[] cities;
+        cities = nullptr, held_cities = 0;
+    }
+
+    // Lets the warrior of the given side that stands at index leave for a neighbour.
+    void emigrate(const int &type, const int &index, Archive &out)
+    {
+        Headquarter *headquarter = side(type);
+        Warrior *warrior = index >= 0 && index <= nCities + 1 ? headquarter->occupant(std::abs(index - headquarter->home)) : nullptr;
+        out << bool(warrior);
+        if (warrior)
+        {
+            Archive state;
+            headquarter->release(warrior, state);
+            out << state.str();
+        }
+    }
+
+    void immigrate(const int &type, Archive &in)
+    {
+        bool present;
+        in >> present;
+        if (!present)
+        {
+            return;
+        }
+        std::string state;
+        in >> state;
+        Archive warrior(state);
+        if (side(type)->adopt(warrior))
+        {
+            (type == red ? red_victory : blue_victory) = 1;
+        }
+    }
+
+    void march_in(Archive &in)
+    {
+        immigrate(red, in), immigrate(blue, in);
+        for (int index = lo; index < hi; ++index)
+        {
+            city_at(index)->warrior_arrive();
+            if (index == 0 && blue_victory)
+            {
+                Blue->report_conquer();
+            }
+            if (index == nCities + 1 && red_victory)
+            {
+                Red->report_conquer();
+            }
+        }
+    }
+
+    // Runs the shot phase over our cities, with the blue warrior of city hi lent by the right neighbour.
+    void shot_run(Archive &in, std::ostringstream &capture, Archive &out)
+    {
+        bool present;
+        in >> present;
+        if (present)
+        {
+            std::string state;
+            in >> state;
+            Archive warrior(state);
+            Blue->adopt(warrior);
+        }
+        for (int index = lo; index < hi; ++index)
+        {
+            city_at(index)->warrior_shot();
+            if (index == lo)
+            {
+                shot_splice = capture.tellp();
+            }
+        }
+        out << present;
+        if (!present)
+        {
+            return;
+        }
+        City *halo = city_at(hi);
+        Warrior *lent = halo->warrior(blue);
+        std::ostringstream line;
+        if (halo->blue_report_shot)
+        {
+            std::streambuf *sink = std::cout.rdbuf(line.rdbuf());
+            lent->report_shot(city_at(hi - 1)->warrior(red));
+            std::cout.rdbuf(sink);
+            halo->blue_report_shot = 0;
+        }
+        Archive state;
+        Blue->release(lent, state);
+        out << state.str() << line.str();
+    }
+
+    void shot_finish(Archive &in)
+    {
+        bool present;
+        in >> present;
+        std::string state, line;
+        if (present)
+        {
+            in >> state >> line;
+            Archive warrior(state);
+            warrior_type _type;
+            warrior >> _type;
+            city_at(lo)->warrior(blue)->load(warrior);
+        }
+        std::cout << shot_output.substr(0, shot_splice) << line << shot_output.substr(shot_splice);
+    }
+
+    void award(Archive &in, Archive &out)
+    {
+        int red_quota, blue_quota;
+        in >> red_quota >> blue_quota;
+        out << Red->award(red_quota) << Blue->award(blue_quota) << Red->elements_buffer << Blue->elements_buffer;
+        Red->elements_buffer = Blue->elements_buffer = 0;
+        for_owned(reset_record_func);
+    }
+
+public:
+    // Answers the coordinator until it hangs up.
+    void serve(const int &fd)
+    {
+        Archive in;
+        while (receive_message(fd, in))
+        {
+            int command;
+            in >> command >> hour >> minute;
+            Span span(shard_command_name[command]);
+            Archive out;
+            std::ostringstream capture;
+            std::streambuf *sink = std::cout.rdbuf(capture.rdbuf());
+            switch (command)
+            {
+            case shard_begin:
+                begin(in);
+                break;
+            case shard_produce:
+            {
+                int type, _type, id;
+                in >> type >> _type >> id >> side(type)->elements;
+                side(type)->warriors = id;
+                side(type)->create(warrior_type(_type), id);
+                break;
+            }
+            case shard_escape:
+                for_owned(lion_escape_func);
+                break;
+            case shard_march_out:
+                red_victory = Red->march_and_if_conquer(), blue_victory = Blue->march_and_if_conquer();
+                emigrate(red, hi, out), emigrate(blue, lo - 1, out);
+                break;
+            case shard_march_in:
+                march_in(in);
+                out << red_victory << blue_victory;
+                break;
+            case shard_produce_elements:
+                for_owned(produce_elements_func, 1);
+                break;
+            case shard_earn:
+                for_owned(earn_elements_func, 1);
+                break;
+            case shard_shot_gather:
+            {
+                Warrior *first = lo > 0 ? city_at(lo)->warrior(blue) : nullptr;
+                out << bool(first);
+                if (first)
+                {
+                    Archive state;
+                    first->save(state);
+                    out << state.str();
+                }
+                break;
+            }
+            case shard_shot_run:
+                shot_run(in, capture, out);
+                shot_output = capture.str(), capture.str("");
+                break;
+            case shard_shot_finish:
+                shot_finish(in);
+                break;
+            case shard_explode:
+                for_owned(explode_func);
+                break;
+            case shard_fight:
+                for_owned(fight_func);
+                break;
+            case shard_award_count:
+                out << Red->count_winners() << Blue->count_winners();
+                break;
+            case shard_award:
+                award(in, out);
+                break;
+            case shard_report_weapons:
+            {
+                int type;
+                in >> type;
+                side(type)->report_weapons();
+                if (type == blue)
+                {
+                    memory.sample(0);
+                    if (tracer.enabled())
+                    {
+                        tracer.count_armies();
+                    }
+                }
+                break;
+            }
+            case shard_end:
+                if (minute)
+                {
+                    memory.sample(0);
+                }
+                end();
+                stats.save(out), memory.save(out);
+                tracer.flush();
+                break;
+            }
+            std::cout.rdbuf(sink);
+            out << capture.str();
+            if (!send_message(fd, out))
+            {
+                break;
+            }
+        }
+    }
+};
+
+// Sockets to the shard workers started by start_shards().
+std::vector<int> shard_sockets;
+
+std::vector<pid_t> shard_pids;
+
+void start_shards(const int &n)
+{
+    std::cout << std::flush;
+    tracer.flush();
+    for (int i = 0; i < n; ++i)
+    {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds))
+        {
+            perror("socketpair");
+            exit(1);
+        }
+        pid_t pid = fork();
+        if (!pid)
+        {
+            for (int fd : shard_sockets)
+            {
+                close(fd);
+            }
+            close(fds[0]);
+            tracer.name_process("shard " + std::to_string(i));
+            Shard().serve(fds[1]);
+            tracer.flush();
+            _exit(0);
+        }
+        close(fds[1]);
+        shard_sockets.push_back(fds[0]);
+        shard_pids.push_back(pid);
+    }
+}
+
+void stop_shards()
+{
+    for (int fd : shard_sockets)
+    {
+        close(fd);
+    }
+    for (pid_t pid : shard_pids)
+    {
+        waitpid(pid, nullptr, 0);
+    }
+    shard_sockets.clear(), shard_pids.clear();
+}
+
+// Splits the cities into contiguous ranges, one per shard worker, and drives the workers phase by phase.
+// Headquarter elements and production stay here; the workers print everything that happens in their
+// cities, and their output is written in city order.
+class ShardedEngine : public Engine
+{
+private:
+    int n;
+
+    std::vector<int> lo;
+
+    Headquarter *Red, *Blue;
+
+    Archive request(const int &command)
+    {
+        Archive message;
+        message << command << hour << minute;
+        return message;
+    }
+
+    void send(const int &shard, const Archive &message)
+    {
+        if (!send_message(shard_sockets[shard], message))
+        {
+            std::cerr << "shard " << shard << " is gone" << std::endl;
+            exit(1);
+        }
+    }
+
+    Archive receive(const int &shard)
+    {
+        Archive reply;
+        if (!receive_message(shard_sockets[shard], reply))
+        {
+            std::cerr << "shard " << shard << " is gone" << std::endl;
+            exit(1);
+        }
+        return reply;
+    }
+
+    void print(Archive &reply)
+    {
+        std::string output;
+        reply >> output;
+        std::cout << output;
+    }
+
+    // Sends the same command to every shard and prints their output in city order.
+    void broadcast(const int &command)
+    {
+        for (int i = 0; i < n; ++i)
+        {
+            send(i, request(command));
+        }
+        for (int i = 0; i < n; ++i)
+        {
+            Archive reply = receive(i);
+            print(reply);
+        }
+    }
+
+    // Copies one optional saved warrior from a reply into a request; returns whether there was one.
+    static bool forward(Archive &from, Archive &to)
+    {
+        bool present;
+        from >> present;
+        to << present;
+        if (present)
+        {
+            std::string state;
+            from >> state;
+            to << state;
+        }
+        return present;
+    }
+
+public:
+    ShardedEngine(const int &shards) : n(std::min(shards, nCities + 2))
+    {
+        for (int i = 0; i <= n; ++i)
+        {
+            lo.push_back(1LL * (nCities + 2) * i / n);
+        }
+        for (int i = 0; i < n; ++i)
+        {
+            Archive message = request(shard_begin);
+            message << init_elements << nCities << arrow_attack << loyalty_decrease << time_limit;
+            for (int j = 0; j < nWarriors; ++j)
+            {
+                message << Warrior::elements_value[j] << Warrior::force_value[j];
+            }
+            message << lo[i] << lo[i + 1];
+            send(i, message);
+        }
+        for (int i = 0; i < n; ++i)
+        {
+            receive(i);
+        }
+        Red = new Headquarter(red), Blue = new Headquarter(blue);
+    }
+
+    // The workers hand back their share of the statistics as they finish the case.
+    ~ShardedEngine()
+    {
+        delete Red, delete Blue;
+        for (int i = 0; i < n; ++i)
+        {
+            send(i, request(shard_end));
+        }
+        for (int i = 0; i < n; ++i)
+        {
+            Archive reply = receive(i);
+            stats.merge(reply), memory.merge(reply);
+            print(reply);
+        }
+    }
+
+    void produce() override
+    {
+        Headquarter *sides[2] = {Red, Blue};
+        for (int type = red; type <= blue; ++type)
+        {
+            int _type = sides[type]->recruit(), shard = type == red ? 0 : n - 1;
+            if (_type < 0)
+            {
+                continue;
+            }
+            Archive message = request(shard_produce);
+            message << type << _type << sides[type]->warriors << sides[type]->elements;
+            send(shard, message);
+            Archive reply = receive(shard);
+            print(reply);
+        }
+    }
+
+    void lion_escape() override { broadcast(shard_escape); }
+
+    bool march() override
+    {
+        std::vector<Archive> leaving;
+        for (int i = 0; i < n; ++i)
+        {
+            send(i, request(shard_march_out));
+        }
+        for (int i = 0; i < n; ++i)
+        {
+            leaving.push_back(receive(i));
+        }
+        std::vector<Archive> arriving(n, Archive());
+        for (int i = 0; i < n; ++i)
+        {
+            arriving[i] = request(shard_march_in);
+        }
+        arriving[0] << false;
+        for (int i = 0; i < n; ++i)
+        {
+            Archive discarded;
+            forward(leaving[i], i + 1 < n ? arriving[i + 1] : discarded);
+            forward(leaving[i], i > 0 ? arriving[i - 1] : discarded);
+        }
+        arriving[n - 1] << false;
+        for (int i = 0; i < n; ++i)
+        {
+            send(i, arriving[i]);
+        }
+        bool victory = 0;
+        for (int i = 0; i < n; ++i)
+        {
+            Archive reply = receive(i);
+            bool red_victory, blue_victory;
+            reply >> red_victory >> blue_victory;
+            victory |= red_victory || blue_victory;
+            print(reply);
+        }
+        return victory;
+    }
+
+    void produce_elements() override { broadcast(shard_produce_elements); }
+
+    void earn_elements() override { broadcast(shard_earn); }
+
+    // Each shard's first blue warrior is lent to its left neighbour for the shots across the boundary and
+    // then handed back with the result.
+    void shot() override
+    {
+        std::vector<Archive> lent, running(n, Archive()), finishing(n, Archive());
+        for (int i = 0; i < n; ++i)
+        {
+            send(i, request(shard_shot_gather));
+        }
+        for (int i = 0; i < n; ++i)
+        {
+            lent.push_back(receive(i));
+        }
+        for (int i = 0; i < n; ++i)
+        {
+            running[i] = request(shard_shot_run);
+            Archive discarded;
+            forward(lent[i], i > 0 ? running[i - 1] : discarded);
+        }
+        running[n - 1] << false;
+        for (int i = 0; i < n; ++i)
+        {
+            send(i, running[i]);
+        }
+        for (int i = 0; i < n; ++i)
+        {
+            finishing[i] = request(shard_shot_finish);
+        }
+        finishing[0] << false;
+        for (int i = 0; i < n; ++i)
+        {
+            Archive reply = receive(i);
+            std::string line;
+            if (i + 1 < n && forward(reply, finishing[i + 1]))
+            {
+                reply >> line;
+                finishing[i + 1] << line;
+            }
+        }
+        for (int i = 0; i < n; ++i)
+        {
+            send(i, finishing[i]);
+        }
+        for (int i = 0; i < n; ++i)
+        {
+            Archive reply = receive(i);
+            print(reply);
+        }
+    }
+
+    void explode() override { broadcast(shard_explode); }
+
+    void fight() override { broadcast(shard_fight); }
+
+    // Awards go out in id order: for red that is from the blue end of the map backwards, for blue from
+    // the red end forwards, so each side's quota is handed to the shards in that order.
+    void award() override
+    {
+        std::vector<int> red_count(n), blue_count(n);
+        for (int i = 0; i < n; ++i)
+        {
+            send(i, request(shard_award_count));
+        }
+        for (int i = 0; i < n; ++i)
+        {
+            Archive reply = receive(i);
+            reply >> red_count[i] >> blue_count[i];
+        }
+        std::vector<int> red_quota(n), blue_quota(n);
+        int red_left = Red->elements / win_award, blue_left = Blue->elements / win_award;
+        for (int i = n - 1; i >= 0; --i)
+        {
+            red_quota[i] = std::min(red_count[i], red_left), red_left -= red_quota[i];
+        }
+        for (int i = 0; i < n; ++i)
+        {
+            blue_quota[i] = std::min(blue_count[i], blue_left), blue_left -= blue_quota[i];
+        }
+        for (int i = 0; i < n; ++i)
+        {
+            Archive message = request(shard_award);
+            message << red_quota[i] << blue_quota[i];
+            send(i, message);
+        }
+        int red_buffer = 0, blue_buffer = 0;
+        for (int i = 0; i < n; ++i)
+        {
+            Archive reply = receive(i);
+            int red_awarded, blue_awarded, red_earned, blue_earned;
+            reply >> red_awarded >> blue_awarded >> red_earned >> blue_earned;
+            Red->elements -= win_award * red_awarded, Blue->elements -= win_award * blue_awarded;
+            red_buffer += red_earned, blue_buffer += blue_earned;
+        }
+        Red->elements += red_buffer, Blue->elements += blue_buffer;
+    }
+
+    void report_elements() override { Red->report_elements(), Blue->report_elements(); }
+
+    void report_weapons() override
+    {
+        for (int type = red; type <= blue; ++type)
+        {
+            for (int i = 0; i < n; ++i)
+            {
+                Archive message = request(shard_report_weapons);
+                message << type;
+                send(i, message);
+            }
+            for (int i = 0; i < n; ++i)
+            {
+                Archive reply = receive(i);
+                print(reply);
+            }
+        }
+    }
+};
+
+// The rules of the current case, as configure() takes them.
+warcraft_config current_config()
+{
+    warcraft_config config;
+    config.elements = init_elements, config.cities = nCities, config.arrow_attack = arrow_attack;
+    config.loyalty_decrease = loyalty_decrease, config.time_limit = time_limit;
+    for (int i = 0; i < nWarriors; ++i)
+    {
+        config.warrior_elements[i] = Warrior::elements_value[i], config.warrior_force[i] = Warrior::force_value[i];
+    }
+    return config;
+}
+
+// A case stopped between two hours: the rules, the clock, the statistics so far and the engine's map,
+// compressed behind a checksum of the plain bytes. Empty if the engine cannot save.
+std::string save_snapshot(Engine &engine)
+{
+    Archive plain, sealed;
+    plain << std::string(engine_version) << current_config() << hour;
+    stats.save(plain);
+    if (!engine.save(plain))
+    {
+        return "";
+    }
+    sealed << fnv1a(plain.str()) << compress_block(plain.str());
+    return sealed.str();
+}
+
+// Adds the statistics of an opened snapshot to the current ones and loads its map.
+bool load_snapshot(Engine &engine, Archive &in)
+{
+    stats.merge(in);
+    return engine.load(in);
+}
+
+// Sets up the rules and clock of a snapshot and leaves in at the rest, for load_snapshot() once the
+// engine is built; returns 0 if the snapshot is damaged or from another version.
+bool open_snapshot(const std::string &data, Archive &in)
+{
+    if (data.size() < 2 * sizeof(uint64_t))
+    {
+        return 0;
+    }
+    Archive sealed(data);
+    uint64_t checksum;
+    std::string packed, plain, version;
+    sealed >> checksum >> packed;
+    if (!decompress_block(packed, plain) || fnv1a(plain) != checksum)
+    {
+        return 0;
+    }
+    in = Archive(plain);
+    warcraft_config config;
+    int _hour;
+    in >> version;
+    if (version != engine_version)
+    {
+        return 0;
+    }
+    in >> config >> _hour;
+    if (!in.ok() || _hour < 0 || !configure(config))
+    {
+        return 0;
+    }
+    hour = _hour;
+    // The checksum only catches damage, so a forged state is loaded once into a scratch engine to be checked.
+    Archive trial = in;
+    Stats kept_stats = stats;
+    Memory kept_memory = memory;
+    bool loaded;
+    {
+        SerialEngine engine;
+        loaded = load_snapshot(engine, trial) && trial.done();
+    }
+    stats = kept_stats, memory = kept_memory;
+    return loaded;
+}
+
+// A case suspended by --budget keeps its snapshot in continuation, taken once the clock passes deadline.
+std::string continuation;
+
+std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+
+// Whether --memory-limit stopped the case before its time limit.
+bool over_memory_limit = 0;
+
+// Whether writing the case failed, as when a --serve client hangs up, so that it was stopped or lost.
+bool output_failed = 0;
+
+// Snapshots taken every few hours by --keyframes, one file per case: length-prefixed snapshots, then
+// an index of (hour, offset) pairs, their count and a tag.
+const uint64_t keyframe_tag = 0x31584449464b4357ULL; // "WCKFIDX1"
+
+class Keyframes
+{
+private:
+    std::ofstream file;
+
+    std::vector<std::pair<int, uint64_t>> index;
+
+    uint64_t offset = 0;
+
+public:
+    void open(const int &k)
+    {
+        mkdir(keyframe_directory.c_str(), 0755);
+        file.open(keyframe_directory + "/case-" + std::to_string(k) + ".wck", std::ios::binary | std::ios::trunc);
+        index.clear(), offset = 0;
+        if (!file)
+        {
+            std::cerr << "cannot write keyframes to " << keyframe_directory << std::endl;
+        }
+    }
+
+    // Called at the top of each hour.
+    void take(Engine &engine)
+    {
+        if (!file.is_open() || hour % keyframe_every)
+        {
+            return;
+        }
+        std::string snapshot = save_snapshot(engine);
+        if (snapshot.empty())
+        {
+            return;
+        }
+        Archive record;
+        record << snapshot;
+        file.write(record.str().data(), record.str().size());
+        index.emplace_back(hour, offset);
+        offset += record.str().size();
+    }
+
+    void close()
+    {
+        if (!file.is_open())
+        {
+            return;
+        }
+        Archive footer;
+        for (auto &entry : index)
+        {
+            footer << entry.first << entry.second;
+        }
+        footer << uint64_t(index.size()) << keyframe_tag;
+        file.write(footer.str().data(), footer.str().size());
+        file.close();
+    }
+} keyframes;
+
+inline bool advance(const int &minutes)
+{
+    minute += minutes;
+    return time_not_valid();
+}
+
+// Passes the phases on to another engine, timing each as a span and each hour as a span around them.
+// At the end of an hour it also counts the armies, unless they are spread over shard workers, which count
+// their own.
+class TracedEngine : public Engine
+{
+private:
+    Engine &engine;
+
+    bool count;
+
+    int traced_hour = 0;
+
+    double hour_start = -1;
+
+    void end_hour()
+    {
+        tracer.span("hour " + std::to_string(traced_hour), hour_start);
+        hour_start = -1;
+        if (count)
+        {
+            tracer.count_armies();
+        }
+    }
+
+public:
+    TracedEngine(Engine &_engine) : engine(_engine), count(!dynamic_cast<ShardedEngine *>(&_engine)) {}
+
+    // The case stopped within an hour.
+    ~TracedEngine()
+    {
+        if (hour_start >= 0)
+        {
+            end_hour();
+        }
+    }
+
+    void produce() override
+    {
+        traced_hour = hour, hour_start = Tracer::now();
+        Span span("produce");
+        engine.produce();
+    }
+
+    void lion_escape() override
+    {
+        Span span("lion_escape");
+        engine.lion_escape();
+    }
+
+    bool march() override
+    {
+        Span span("march");
+        return engine.march();
+    }
+
+    void produce_elements() override
+    {
+        Span span("produce_elements");
+        engine.produce_elements();
+    }
+
+    void earn_elements() override
+    {
+        Span span("earn_elements");
+        engine.earn_elements();
+    }
+
+    void shot() override
+    {
+        Span span("shot");
+        engine.shot();
+    }
+
+    void explode() override
+    {
+        Span span("explode");
+        engine.explode();
+    }
+
+    void fight() override
+    {
+        Span span("fight");
+        engine.fight();
+    }
+
+    void award() override
+    {
+        Span span("award");
+        engine.award();
+    }
+
+    void report_elements() override
+    {
+        Span span("report_elements");
+        engine.report_elements();
+    }
+
+    void report_weapons() override
+    {
+        {
+            Span span("report_weapons");
+            engine.report_weapons();
+        }
+        end_hour();
+    }
+
+    bool save(Archive &out) override { return engine.save(out); }
+
+    bool load(Archive &in) override { return engine.load(in); }
+};
+
+void run_hours(Engine &engine);
+
+// Runs the case from the current hour. Out of --budget, it stops at the start of an hour, once at least one
+// hour has run, if the engine can be saved there.
+void simulate(Engine &engine)
+{
+    if (!tracer.enabled())
+    {
+        run_hours(engine);
+        return;
+    }
+    TracedEngine traced(engine);
+    run_hours(traced);
+}
+
+void run_hours(Engine &engine)
+{
+    int first_hour = hour;
+    while (!time_not_valid())
+    {
+        // The output has failed, as when a --serve client hangs up: nothing more of the case can be delivered.
+        if (!event_callback && std::cout.bad())
+        {
+            output_failed = 1;
+            break;
+        }
+        if (budget_ms && hour > first_hour && std::chrono::steady_clock::now() > deadline && !(continuation = save_snapshot(engine)).empty())
+        {
+            break;
+        }
+        keyframes.take(engine);
+        engine.produce();
+        if (advance(5))
+        {
+            break;
+        }
+        engine.lion_escape();
+        if (advance(5) || engine.march())
+        {
+            break;
+        }
+        if (advance(10))
+        {
+            break;
+        }
+        engine.produce_elements();
+        if (advance(10))
+        {
+            break;
+        }
+        engine.earn_elements();
+        if (advance(5))
+        {
+            break;
+        }
+        engine.shot();
+        if (advance(3))
+        {
+            break;
+        }
+        engine.explode();
+        if (advance(2))
+        {
+            break;
+        }
+        engine.fight();
+        engine.award();
+        if (advance(10))
+        {
+            break;
+        }
+        engine.report_elements();
+        if (advance(5))
+        {
+            break;
+        }
+        engine.report_weapons();
+        if (!memory.sample(memory_limit))
+        {
+            over_memory_limit = 1;
+            break;
+        }
+        ++hour, minute = 0;
+    }
+    if (minute)
+    {
+        memory.sample(0);
+    }
+}
+
+void resume(Engine &engine)
+{
+    if (resuming)
+    {
+        load_snapshot(engine, resume_state);
+        resuming = 0;
+    }
+}
+
+void discard_event(const warcraft_event *, void *) {}
+
+// The time a case takes on each engine, as a cost per hour plus a cost per visited city and hour, fitted on this host
+// by timing each engine on a small and a wide synthetic map. --engine auto picks the cheapest for each case.
+// Sharded costs are measured with every started worker and scaled to fewer: the hourly exchange grows with
+// the number of workers and the city work shrinks with it.
+class CostModel
+{
+private:
+    enum
+    {
+        serial,
+        fused,
+        sparse,
+        sharded
+    };
+
+    static const char *engine_names[4];
+
+    bool calibrated = 0;
+
+    int workers = 0;
+
+    // Seconds.
+    double per_hour[4] = {}, per_city_hour[4] = {};
+
+    static double run(const int &kind, const int &_cities, const int &hours, const int &shards)
+    {
+        warcraft_config config = {10000, _cities, 20, 10, 60 * hours - 1, {30, 20, 40, 50, 30}, {15, 10, 20, 25, 18}};
+        configure(config);
+        auto start = std::chrono::steady_clock::now();
+        if (kind == sharded)
+        {
+            ShardedEngine engine(shards);
+            simulate(engine);
+        }
+        else
+        {
+            Engine *engine = make_engine(engine_names[kind]);
+            simulate(*engine);
+            delete engine;
+        }
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // Cities visited per hour: the sparse engine visits at most those a warrior of each side born every hour
+    // can reach.
+    static double width(const int &engine, const double &map, const double &hours) { return engine == sparse ? std::min(map, 2 * hours) : map; }
+
+    double estimate(const int &engine, const int &shards, const double &hours)
+    {
+        if (engine != sharded)
+        {
+            return hours * (per_hour[engine] + per_city_hour[engine] * width(engine, nCities + 2.0, hours));
+        }
+        return hours * (per_hour[sharded] * shards / workers + per_city_hour[sharded] * (nCities + 2.0) * workers / shards);
+    }
+
+public:
+    // Runs the synthetic cases, leaving the current case, statistics and memory accounts as they were.
+    // Shards are timed when there are workers to run them.
+    void calibrate()
+    {
+        if (calibrated)
+        {
+            return;
+        }
+        calibrated = 1, workers = shard_count > 1 ? shard_count : 0;
+        warcraft_config config = current_config();
+        int _hour = hour, _minute = minute;
+        long long limit = memory_limit;
+        Stats _stats = stats;
+        Memory _memory = memory;
+        warcraft_callback callback = event_callback;
+        void *context = event_context;
+        // Shards print their cities' lines themselves rather than through the callback.
+        event_callback = discard_event, memory_limit = 0;
+        std::cout << std::flush;
+        std::cout.setstate(std::ios::badbit);
+        const int hours = 32, narrow = 8, wide = 1 << 14;
+        for (int engine = serial; engine <= (workers ? sharded : sparse); ++engine)
+        {
+            double t_narrow = 1e9, t_wide = 1e9;
+            for (int i = 0; i < 3; ++i)
+            {
+                t_narrow = std::min(t_narrow, run(engine, narrow, hours, workers));
+                t_wide = std::min(t_wide, run(engine, wide, hours, workers));
+            }
+            double w_narrow = width(engine, narrow + 2, hours), w_wide = width(engine, wide + 2, hours);
+            per_city_hour[engine] = std::max(0.0, (t_wide - t_narrow) / (w_wide - w_narrow) / hours);
+            per_hour[engine] = std::max(0.0, t_narrow / hours - per_city_hour[engine] * w_narrow);
+            std::ostringstream log;
+            log << "calibration: " << engine_names[engine] << (engine == sharded ? " x" + std::to_string(workers) : "") << ' ' << std::fixed << std::setprecision(0) << per_hour[engine] * 1e9 << " ns/hour + " << std::setprecision(2) << per_city_hour[engine] * 1e9 << " ns/city-hour";
+            std::cerr << log.str() << std::endl;
+        }
+        std::cout.clear();
+        configure(config);
+        hour = _hour, minute = _minute, memory_limit = limit;
+        stats = _stats, memory = _memory;
+        event_callback = callback, event_context = context;
+    }
+
+    // Returns the engine for the current case and sets shards to its worker count, 0 unless sharded. Shards
+    // are only considered if allowed.
+    std::string choose(int &shards, const bool &allow_shards)
+    {
+        calibrate();
+        double hours = (time_limit - 60.0 * hour) / 60 + 1;
+        int best = serial, best_shards = 0;
+        double best_cost = estimate(serial, 0, hours);
+        std::ostringstream log;
+        log << "engine: " << nCities << " cities, " << (long long)hours << " hours:";
+        for (int engine = serial; engine <= sharded; ++engine)
+        {
+            for (int k = engine == sharded ? 2 : 0; k <= (engine == sharded ? workers : 0); ++k)
+            {
+                if (engine == sharded && (!allow_shards || k > nCities + 2))
+                {
+                    break;
+                }
+                double cost = estimate(engine, k, hours);
+                if (engine != sharded || k == workers)
+                {
+                    log << ' ' << engine_names[engine] << (k ? " x" + std::to_string(k) : "") << ' ' << std::fixed << std::setprecision(3) << cost * 1e3 << " ms,";
+                }
+                if (cost < best_cost)
+                {
+                    best = engine, best_shards = k, best_cost = cost;
+                }
+            }
+        }
+        shards = best_shards;
+        std::cerr << log.str() << " chose " << engine_names[best] << (shards ? " x" + std::to_string(shards) : "") << std::endl;
+        return engine_names[best];
+    }
+} cost_model;
+
+const char *CostModel::engine_names[4] = {"serial", "fused", "sparse", "sharded"};
+
+// A resumed case runs in this process, since shards cannot load a snapshot.
+void simulate()
+{
+    int shards = shard_count > 1 && !resuming ? shard_count : 0;
+    std::string name = engine_name == "auto" ? cost_model.choose(shards, shards > 1) : engine_name;
+    if (shards > 1)
+    {
+        ShardedEngine engine(shards);
+        simulate(engine);
+        return;
+    }
+    Engine *engine = make_engine(name);
+    resume(*engine);
+    simulate(*engine);
+    delete engine;
+}
+
+void Stats::print(std::ostream &out, const int &k)
+{
+    out << "{\"case\":" << k << ",\"cities\":" << nCities;
+    const char *tally_name[2] = {"kills", "deaths"};
+    long long *tally[2] = {kills, deaths};
+    for (int j = 0; j < 2; ++j)
+    {
+        out << ",\"" << tally_name[j] << "\":{";
+        for (int i = 0; i < nWarriors; ++i)
+        {
+            out << (i ? "," : "") << '"' << Warrior::warrior_name[i] << "\":" << tally[j][i];
+        }
+        out << '}';
+    }
+    out << ",\"bombs\":" << bombs << ",\"arrow_kills\":" << arrow_kills << ",\"lion_escapes\":" << lion_escapes << ",\"dragon_yells\":" << dragon_yells;
+    out << ",\"income\":{\"red\":" << income[red] << ",\"blue\":" << income[blue] << "},\"conquest\":{";
+    for (int type = red; type <= blue; ++type)
+    {
+        out << (type ? "," : "") << '"' << Headquarter::headquarter_name[type] << "\":";
+        if (conquest[type] < 0)
+        {
+            out << "null";
+        }
+        else
+        {
+            out << conquest[type];
+        }
+    }
+    out << "},\"flags\":{";
+    for (auto p = flags.begin(); p != flags.end(); ++p)
+    {
+        out << (p == flags.begin() ? "" : ",") << '"' << p->first << "\":" << p->second;
+    }
+    out << "}}" << std::endl;
+}
+
+bool Memory::sample(const long long &limit)
+{
+    hourly.resize(hour + 1);
+    hourly[hour] = total.live;
+    if (limit && total.live > limit)
+    {
+        std::cerr << "memory limit exceeded at hour " << hour << ": " << total.live << " bytes live" << std::endl;
+        return 0;
+    }
+    return 1;
+}
+
+void print_gauge(std::ostream &out, const char *name, const Gauge &gauge, const long long &size) { out << '"' << name << "\":{\"live\":" << gauge.live << ",\"peak\":" << gauge.peak << ",\"peak_bytes\":" << gauge.peak * size << '}'; }
+
+// Counts still live here were not freed when the case's engine went away.
+void Memory::print(std::ostream &out, const int &k)
+{
+    out << "{\"case\":" << k << ",\"peak_bytes\":" << total.peak << ",\"leaked_bytes\":" << total.live << ",\"warriors\":{";
+    for (int i = 0; i < nWarriors; ++i)
+    {
+        out << (i ? "," : ""), print_gauge(out, Warrior::warrior_name[i].c_str(), warriors[i], warrior_size[i]);
+    }
+    out << "},\"weapons\":{";
+    const char *weapon_name[nWeapons] = {"sword", "bomb", "arrow"};
+    for (int i = 0; i < nWeapons; ++i)
+    {
+        out << (i ? "," : ""), print_gauge(out, weapon_name[i], weapons[i], weapon_size[i]);
+    }
+    out << "},", print_gauge(out, "cities", cities, city_size);
+    out << ',', print_gauge(out, "pool_nodes", pool_nodes, pool_node_size);
+    out << ',', print_gauge(out, "roster_slots", roster_slots, sizeof(Warrior *));
+    out << ',', print_gauge(out, "lane_slots", lane_slots, sizeof(Warrior *));
+    out << ",\"hourly_bytes\":[";
+    for (size_t i = 0; i < hourly.size(); ++i)
+    {
+        out << (i ? "," : "") << hourly[i];
+    }
+    out << "]}" << std::endl;
+}
+
+// Passes output on to sink and keeps a copy of the first limit bytes; copied tells whether that was all.
+class TeeBuffer : public std::streambuf
+{
+private:
+    std::streambuf *sink;
+
+    size_t limit;
+
+protected:
+    std::streamsize xsputn(const char *data, std::streamsize size) override
+    {
+        if (copied && copy.size() + size <= limit)
+        {
+            copy.append(data, size);
+        }
+        else if (copied)
+        {
+            copied = 0, std::string().swap(copy);
+        }
+        return sink->sputn(data, size);
+    }
+
+    int overflow(int c) override
+    {
+        char ch = c;
+        if (c != EOF && xsputn(&ch, 1) != 1)
+        {
+            return EOF;
+        }
+        return c == EOF ? 0 : c;
+    }
+
+    int sync() override { return sink->pubsync(); }
+
+public:
+    std::string copy;
+
+    bool copied = 1;
+
+    TeeBuffer(std::streambuf *_sink, const size_t &_limit) : sink(_sink), limit(_limit) {}
+};
+
+// The case header and the engine version, which together decide the output of a case.
+std::string case_key()
+{
+    std::ostringstream tuple;
+    tuple << engine_version << ' ' << init_elements << ' ' << nCities << ' ' << arrow_attack << ' ' << loyalty_decrease << ' ' << time_limit;
+    for (int i = 0; i < nWarriors; ++i)
+    {
+        tuple << ' ' << Warrior::elements_value[i] << ' ' << Warrior::force_value[i];
+    }
+    return tuple.str();
+}
+
+// Cache entries keep the case statistics ahead of the output, so a replayed case still has its record.
+// A missed case is printed as it runs and stored afterwards, unless its output outgrew what the cache keeps.
+// Suspended cases are not stored, nor ones stopped by --memory-limit or whose output failed.
+void simulate_cached(warcraft_cache &cache)
+{
+    std::string key = case_key(), entry, body;
+    if (cache.lookup(key, entry))
+    {
+        Archive in(entry);
+        stats.merge(in);
+        in >> body;
+        std::cout << body;
+        return;
+    }
+    TeeBuffer tee(std::cout.rdbuf(), cache.largest());
+    std::streambuf *sink = std::cout.rdbuf(&tee);
+    simulate();
+    std::cout.rdbuf(sink);
+    std::cout << std::flush;
+    output_failed |= std::cout.bad();
+    if (tee.copied && continuation.empty() && !over_memory_limit && !output_failed)
+    {
+        Archive out;
+        stats.save(out);
+        out << tee.copy;
+        cache.store(key, out.str());
+    }
+}
+
+// Cases taking keyframes are always simulated, since a cached one has no states to take, and so are resumed
+// ones, which do not start at the beginning. A suspended case ends with its continuation token.
+void run_case(const int &k, warcraft_cache *cache)
+{
+    double trace_start = Tracer::now();
+    stats = Stats(), memory = Memory();
+    continuation.clear(), over_memory_limit = output_failed = 0;
+    deadline = budget_ms ? std::chrono::steady_clock::now() + std::chrono::milliseconds(budget_ms) : std::chrono::steady_clock::time_point::max();
+    std::cout << "Case " << k << ':' << std::endl;
+    if (!keyframe_directory.empty())
+    {
+        keyframes.open(k);
+        simulate();
+        keyframes.close();
+    }
+    else if (!cache || resuming)
+    {
+        simulate();
+    }
+    else
+    {
+        simulate_cached(*cache);
+    }
+    if (!continuation.empty())
+    {
+        std::cout << "Continue: " << to_base64(continuation) << std::endl;
+    }
+    if (tracer.enabled())
+    {
+        std::ostringstream args;
+        args << "{\"cities\":" << nCities << ",\"time_limit\":" << time_limit << '}';
+        tracer.span("Case " + std::to_string(k), trace_start, args.str());
+    }
+}
+
+// Runs hours from to to of the case whose keyframes are in path, their events going to callback. The engine
+// starts from the last keyframe at or before from and runs the hours up to it without events. Returns -1 if
+// path is not a keyframe file and -2 if it has no usable keyframe.
+int replay(const char *path, const int &from, const int &to, warcraft_callback callback, void *context)
+{
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    long long size = file ? (long long)file.tellg() : 0, count_at = size - 2 * sizeof(uint64_t);
+    uint64_t count = 0, tag = 0;
+    if (count_at >= 0)
+    {
+        file.seekg(count_at);
+        file.read(reinterpret_cast<char *>(&count), sizeof count).read(reinterpret_cast<char *>(&tag), sizeof tag);
+    }
+    const uint64_t entry_size = sizeof(int) + sizeof(uint64_t);
+    if (!file || tag != keyframe_tag || count > uint64_t(count_at) / entry_size)
+    {
+        return -1;
+    }
+    std::string index(count * entry_size, '\0');
+    file.seekg(count_at - index.size());
+    file.read(&index[0], index.size());
+    Archive entries(index);
+    int start = -1;
+    uint64_t offset = 0;
+    for (uint64_t i = 0; i < count; ++i)
+    {
+        int _hour;
+        uint64_t _offset;
+        entries >> _hour >> _offset;
+        if (_hour <= from && _hour > start)
+        {
+            start = _hour, offset = _offset;
+        }
+    }
+    uint64_t length = 0;
+    std::string snapshot;
+    if (start >= 0 && file.seekg(offset).read(reinterpret_cast<char *>(&length), sizeof length) && length <= uint64_t(size))
+    {
+        snapshot.resize(length);
+        file.read(&snapshot[0], length);
+    }
+    Archive in;
+    if (start < 0 || !file || !open_snapshot(snapshot, in))
+    {
+        return -2;
+    }
+    stats = Stats(), memory = Memory();
+    Engine *engine = make_engine(engine_name);
+    load_snapshot(*engine, in);
+    int limit = time_limit;
+    warcraft_callback callback_before = event_callback;
+    void *context_before = event_context;
+    event_callback = discard_event, time_limit = std::min(limit, 60 * from - 1);
+    simulate(*engine);
+    event_callback = callback, event_context = context, time_limit = std::min<long long>(limit, 60LL * to + 59);
+    // A case that ended before the window leaves the clock within the hour it stopped in.
+    if (hour == from && !minute)
+    {
+        simulate(*engine);
+    }
+    delete engine;
+    event_callback = callback_before, event_context = context_before;
+    std::cout << std::flush;
+    return 0;
+}
+
+struct EventArray
+{
+    warcraft_event *events;
+
+    size_t capacity;
+
+    long long count;
+};
+
+void store_event(const warcraft_event *event, void *context)
+{
+    EventArray *array = static_cast<EventArray *>(context);
+    if (size_t(array->count) < array->capacity)
+    {
+        array->events[array->count] = *event;
+    }
+    ++array->count;
+}
+
+void call_function(const warcraft_event *event, void *context) { (*static_cast<const std::function<void(const warcraft_event &)> *>(context))(*event); }
+}
+
+// The library interface declared in WarCraft.h. Cases run on the in-process engine and their events go to
+// the caller instead of the text output.
+int warcraft_run(const warcraft_config *config, warcraft_callback callback, void *context)
+{
+    if (!configure(*config))
+    {
+        return -1;
+    }
+    warcraft_callback callback_before = event_callback;
+    void *context_before = event_context;
+    event_callback = callback, event_context = context;
+    stats = Stats(), memory = Memory();
+    Engine *engine = make_engine(engine_name);
+    simulate(*engine);
+    delete engine;
+    event_callback = callback_before, event_context = context_before;
+    return 0;
+}
+
+long long warcraft_run_into(const warcraft_config *config, warcraft_event *events, size_t capacity)
+{
+    EventArray array = {events, capacity, 0};
+    return warcraft_run(config, store_event, &array) ? -1 : array.count;
+}
+
+int warcraft_format(const warcraft_event *event, char *buffer, size_t size)
+{
+    std::ostringstream line;
+    print_event(line, *event);
+    return snprintf(buffer, size, "%s", line.str().c_str());
+}
+
+int warcraft_replay(const char *path, int from, int to, warcraft_callback callback, void *context) { return replay(path, from, to, callback, context); }
+
+int warcraft_run(const warcraft_config &config, const std::function<void(const warcraft_event &)> &callback)
+{
+    return warcraft_run(&config, call_function, const_cast<std::function<void(const warcraft_event &)> *>(&callback));
+}
+
+int warcraft_run(const warcraft_config &config, std::vector<warcraft_event> &events) { return warcraft_run(&config, append_event, &events); }
+
+// The executable's interface: cases printed as text to std::cout, under the options of its command line.
+void warcraft_setup(const warcraft_options &options)
+{
+    engine_name = options.engine, shard_count = options.shards, report_threads = options.report_threads;
+    memory_limit = options.memory_limit, budget_ms = options.budget_ms;
+    keyframe_directory = options.keyframes, keyframe_every = options.keyframe_every;
+}
+
+void warcraft_start()
+{
+    if (shard_count > 1)
+    {
+        start_shards(shard_count);
+    }
+    if (engine_name == "auto")
+    {
+        cost_model.calibrate();
+    }
+}
+
+void warcraft_stop() { stop_shards(); }
+
+int warcraft_print(const warcraft_config &config, int k, warcraft_cache *cache)
+{
+    if (!configure(config))
+    {
+        return -1;
+    }
+    run_case(k, cache);
+    return 0;
+}
+
+int warcraft_resume(const std::string &token, int k)
+{
+    std::string snapshot;
+    if (!from_base64(token, snapshot) || !open_snapshot(snapshot, resume_state))
+    {
+        return -1;
+    }
+    resuming = 1;
+    run_case(k, nullptr);
+    return 0;
+}
+
+void warcraft_stats(std::ostream &out, int k) { stats.print(out, k); }
+
+void warcraft_memory(std::ostream &out, int k) { memory.print(out, k); }
+
+bool warcraft_trace(const char *path) { return tracer.open(path); }
+
+void warcraft_trace_process(const std::string &name) { tracer.name_process(name); }
+
+double warcraft_trace_now() { return Tracer::now(); }
+
+void warcraft_trace_span(const std::string &name, double start, const std::string &args) { tracer.span(name, start, args); }
+
+void warcraft_trace_flush() { tracer.flush(); }
@@ -0,0 +1,161 @@
+#ifndef WARCRAFT_H
+#define WARCRAFT_H
+
+#include <stddef.h>
+
+/* Sides are 0 for red and 1 for blue; warrior types are 0 dragon, 1 ninja, 2 iceman, 3 lion, 4 wolf. */
+
+/* One line of the text output each. */
+enum warcraft_event_kind
+{
+    WARCRAFT_BORN,        /* subject */
+    WARCRAFT_MORALE,      /* subject, morale: the line after a dragon is born */
+    WARCRAFT_LOYALTY,     /* subject, value: loyalty, the line after a lion is born */
+    WARCRAFT_RAN_AWAY,    /* subject */
+    WARCRAFT_MARCHED,     /* subject, city, value: elements, force */
+    WARCRAFT_REACHED,     /* subject, value: elements, force; the enemy headquarter */
+    WARCRAFT_TAKEN,       /* side: the headquarter taken */
+    WARCRAFT_EARNED,      /* subject, value: elements sent home */
+    WARCRAFT_SHOT,        /* subject, object, value: 1 if the object was killed */
+    WARCRAFT_BOMB,        /* subject, object */
+    WARCRAFT_ATTACKED,    /* subject, object, city, value: elements, force */
+    WARCRAFT_FOUGHT_BACK, /* subject, object, city */
+    WARCRAFT_KILLED,      /* subject, city */
+    WARCRAFT_YELLED,      /* subject, city */
+    WARCRAFT_FLAG,        /* side, city */
+    WARCRAFT_ELEMENTS,    /* side, value: elements in the headquarter */
+    WARCRAFT_WEAPONS      /* subject, weapons: the sword's attack, 1 for a bomb and the arrows left, or -1 if not carried */
+};
+
+typedef struct warcraft_warrior
+{
+    int side, type, id;
+} warcraft_warrior;
+
+/* Fields not listed for the kind are zero. */
+typedef struct warcraft_event
+{
+    int kind, hour, minute;
+    warcraft_warrior subject, object;
+    int side, city, value, force;
+    double morale;
+    int weapons[3];
+} warcraft_event;
+
+/* One case, as given by its header in data.in. Warrior arrays are in type order. */
+typedef struct warcraft_config
+{
+    int elements, cities, arrow_attack, loyalty_decrease, time_limit;
+    int warrior_elements[5], warrior_force[5];
+} warcraft_config;
+
+typedef void (*warcraft_callback)(const warcraft_event *event, void *context);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Runs one case in this process, calling callback for each event in output order.
+   Returns 0, or -1 if the config is out of range. Not reentrant: one case at a time per process. */
+int warcraft_run(const warcraft_config *config, warcraft_callback callback, void *context);
+
+/* Runs one case and stores its first capacity events; returns how many events the case had, or -1. */
+long long warcraft_run_into(const warcraft_config *config, warcraft_event *events, size_t capacity);
+
+/* Writes the text line of an event, without the newline; returns its length as snprintf does. */
+int warcraft_format(const warcraft_event *event, char *buffer, size_t size);
+
+/* Runs hours from to to of a case from the keyframes written for it to path, starting at the last keyframe at or
+   before from; the hours before from run without events. A null callback prints the lines to standard output.
+   Returns 0, -1 if path is not a keyframe file, or -2 if it has no usable keyframe. */
+int warcraft_replay(const char *path, int from, int to, warcraft_callback callback, void *context);
+
+#ifdef __cplusplus
+}
+
+#include <functional>
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+int warcraft_run(const warcraft_config &config, const std::function<void(const warcraft_event &)> &callback);
+
+// Appends the case's events to events, which the caller may reserve ahead.
+int warcraft_run(const warcraft_config &config, std::vector<warcraft_event> &events);
+
+// The rest is what the WarCraft executable is built on: cases printed to std::cout as WarCraft.out has them,
+// under the options of its command line.
+struct warcraft_options
+{
+    // serial, fused, sparse, or auto to time them at start and pick one per case.
+    std::string engine = "fused";
+
+    // Forked workers splitting the map, used when more than 1.
+    int shards = 0;
+
+    // Threads formatting large weapons reports, 0 for one per core.
+    int report_threads = 0;
+
+    // Live bytes past which a case is stopped at the end of the hour, or 0.
+    long long memory_limit = 0;
+
+    // Wall-clock milliseconds after which a case is suspended, or 0.
+    long long budget_ms = 0;
+
+    // Where the keyframes of every case are written, keyframe_every hours apart, or empty.
+    std::string keyframes;
+
+    int keyframe_every = 100;
+};
+
+// Applies options to the calls that follow, these and the ones above.
+void warcraft_setup(const warcraft_options &options);
+
+// Starts the shard workers and times the engines for auto; warcraft_stop() stops the workers.
+void warcraft_start();
+
+void warcraft_stop();
+
+// Where finished cases are kept from one run to the next.
+class warcraft_cache
+{
+public:
+    virtual ~warcraft_cache() {}
+
+    // Fills entry with what was stored under key, if it is still kept.
+    virtual bool lookup(const std::string &key, std::string &entry) = 0;
+
+    virtual void store(const std::string &key, const std::string &entry) = 0;
+
+    // Cases whose output is longer are not stored, so that it need not be held while they run.
+    virtual long long largest() = 0;
+};
+
+// Prints case k under its "Case k:" line, from cache when it has the case; a case suspended by the budget ends
+// with a "Continue: TOKEN" line. Returns -1, printing nothing, if the config is out of range.
+int warcraft_print(const warcraft_config &config, int k, warcraft_cache *cache = nullptr);
+
+// Prints as case k the rest of a case from the token it was suspended with; returns -1, printing nothing, if the
+// token is damaged, forged or from another version.
+int warcraft_resume(const std::string &token, int k);
+
+// Write the JSON records of the statistics and memory of the case printed last, numbered k.
+void warcraft_stats(std::ostream &out, int k);
+
+void warcraft_memory(std::ostream &out, int k);
+
+// A Chrome trace timeline to which this process and the workers it forks append their spans; the records
+// are buffered, and warcraft_trace_flush() writes them out, as is needed before a fork.
+bool warcraft_trace(const char *path);
+
+void warcraft_trace_process(const std::string &name);
+
+// Microseconds, the start of a span ending now; args is a JSON object or empty.
+double warcraft_trace_now();
+
+void warcraft_trace_span(const std::string &name, double start, const std::string &args = "");
+
+void warcraft_trace_flush();
+#endif
+
+#endif
@@ -0,0 +1,346 @@
+#include "WarCraft.cpp"
+
+#include <chrono>
+#include <cstdlib>
+#include <new>
+
+long long allocations = 0;
+
+void *operator new(std::size_t size)
+{
+    ++allocations;
+    if (void *p = std::malloc(size ? size : 1))
+    {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void *operator new[](std::size_t size) { return operator new(size); }
+
+// Kept out of line: once inlined, GCC sees free() called on memory from operator new and warns.
+__attribute__((noinline)) void operator delete(void *p) noexcept { std::free(p); }
+
+__attribute__((noinline)) void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+
+__attribute__((noinline)) void operator delete[](void *p) noexcept { std::free(p); }
+
+__attribute__((noinline)) void operator delete[](void *p, std::size_t) noexcept { std::free(p); }
+
+const char *filter = nullptr;
+
+// The friend that WarCraft.cpp declares in its unnamed namespace.
+namespace
+{
+struct Bench
+{
+    City *city;
+
+    Headquarter *Red, *Blue;
+
+    Bench(const int &cities)
+    {
+        rules(cities);
+        ::cities = city = City::build(0, nCities + 2), first_city = 0, held_cities = nCities + 2;
+        Red = new Headquarter(red), Blue = new Headquarter(blue);
+        Red->steps = Blue->steps = nCities + 1;
+    }
+
+    ~Bench()
+    {
+        delete Red, delete Blue;
+        delete[] city;
+        ::cities = nullptr, held_cities = 0;
+    }
+
+    template <class W, class... Args>
+    W *spawn(Headquarter *headquarter, const int &index, Args... args)
+    {
+        int id = ++headquarter->warriors;
+        Warrior *home = headquarter->occupant(0);
+        W *warrior = new W(headquarter, id, args...);
+        headquarter->pWarriors.push(warrior);
+        place(warrior, index);
+        if (home && warrior->birth != headquarter->steps)
+        {
+            headquarter->enlist(home);
+        }
+        return warrior;
+    }
+
+    // Rewrites the warrior's birth step so that it stands at city index.
+    void place(Warrior *warrior, const int &index)
+    {
+        Headquarter *headquarter = warrior->pHeadquarter;
+        int distance = std::abs(index - headquarter->home);
+        headquarter->vacate(warrior);
+        if (distance == nCities + 1)
+        {
+            warrior->birth = headquarter->steps - distance;
+            headquarter->stopped = warrior;
+            return;
+        }
+        warrior->birth = headquarter->steps - distance;
+        headquarter->lane_slot(warrior->birth) = warrior;
+    }
+
+    static void rules(const int &cities)
+    {
+        nCities = cities, arrow_attack = 20, loyalty_decrease = 10;
+        init_elements = INT32_MAX / 2, time_limit = INT32_MAX, hour = minute = 0;
+        int elements[nWarriors] = {30, 20, 40, 50, 30}, force[nWarriors] = {15, 10, 20, 25, 18};
+        for (int i = 0; i < nWarriors; ++i)
+        {
+            Warrior::elements_value[i] = elements[i], Warrior::force_value[i] = force[i];
+        }
+    }
+
+    static void revive(Warrior *warrior)
+    {
+        if (warrior->elements < (1 << 20))
+        {
+            warrior->elements = 1 << 30;
+        }
+    }
+
+    static void run_all();
+};
+}
+
+template <class Op>
+void run(const char *name, Op op)
+{
+    if (filter && !strstr(name, filter))
+    {
+        return;
+    }
+    using clock = std::chrono::steady_clock;
+    long long n = 1;
+    for (;;)
+    {
+        long long start_allocations = allocations;
+        auto start = clock::now();
+        for (long long i = 0; i < n; ++i)
+        {
+            op(i);
+        }
+        double elapsed = std::chrono::duration<double, std::nano>(clock::now() - start).count();
+        if (elapsed >= 2e8 || n >= (1LL << 34))
+        {
+            std::cerr << std::left << std::setw(52) << name << std::right << std::fixed << std::setprecision(2) << std::setw(12) << elapsed / n << " ns/op" << std::setw(10) << 1.0 * (allocations - start_allocations) / n << " allocs/op" << std::endl;
+            return;
+        }
+        n <<= 1;
+    }
+}
+
+volatile int sink;
+
+void Bench::run_all()
+{
+    {
+        Bench map(4);
+        Dragon *attacker = map.spawn<Dragon>(map.Red, 2, 2.0);
+        Lion *defender = map.spawn<Lion>(map.Blue, 2, 100);
+        run("Warrior::preview", [&](long long i) { sink = attacker->preview(defender, i & 1 ? Actively : Passively); });
+    }
+    {
+        Bench map(4);
+        Wolf *attacker = map.spawn<Wolf>(map.Red, 2);
+        Dragon *defender = map.spawn<Dragon>(map.Blue, 2, 1.0);
+        run("Warrior::actively_attack", [&](long long) {
+            attacker->actively_attack(defender);
+            Bench::revive(defender);
+        });
+        run("Warrior::passively_attack", [&](long long) {
+            defender->passively_attack(attacker);
+            Bench::revive(attacker);
+        });
+    }
+    {
+        Bench map(4);
+        Iceman *shooter = map.spawn<Iceman>(map.Red, 1);
+        Wolf *target = map.spawn<Wolf>(map.Blue, 2);
+        run("Warrior::try_to_shot (re-arm every 3 shots)", [&](long long) {
+            if (!shooter->pWeapons[arrow])
+            {
+                shooter->get_weapon(arrow);
+            }
+            sink = shooter->try_to_shot(target);
+            Bench::revive(target);
+        });
+    }
+    {
+        Bench map(4);
+        Ninja *bomber = map.spawn<Ninja>(map.Red, 2);
+        Wolf *target = map.spawn<Wolf>(map.Blue, 2);
+        target->elements = 1 << 30;
+        run("Warrior::try_to_use_bomb (hold)", [&](long long) { sink = bomber->try_to_use_bomb(target, red); });
+        run("Warrior::try_to_use_bomb (fire, re-arm)", [&](long long) {
+            if (!bomber->pWeapons[bomb])
+            {
+                bomber->get_weapon(bomb);
+            }
+            bomber->elements = 1, target->elements = 1 << 30;
+            sink = bomber->try_to_use_bomb(target, red);
+        });
+    }
+    {
+        const int army = 1000;
+        Bench map(army);
+        for (int i = 0; i < army; ++i)
+        {
+            map.spawn<Iceman>(map.Red, i);
+        }
+        run("Headquarter::march_and_if_conquer (1000 warriors)", [&](long long) {
+            map.Red->march_and_if_conquer();
+            if (map.Red->stopped)
+            {
+                map.place(map.Red->stopped, 0);
+            }
+        });
+        Warrior *walker = map.Red->stopped ? map.Red->stopped : *map.Red->pWarriors.begin();
+        run("Iceman::during_march", [&](long long) {
+            walker->during_march();
+            walker->force = Warrior::force_value[iceman];
+        });
+    }
+    {
+        Bench map(4);
+        Wolf *picker = map.spawn<Wolf>(map.Red, 2);
+        City *city = map.city + 2;
+        run("Warrior::pick_weapon (3 weapons in pool)", [&](long long) {
+            for (int i = 0; i < nWeapons; ++i)
+            {
+                if (picker->pWeapons[i])
+                {
+                    city->weapon_pool.emplace(weapon_type(i), picker->pWeapons[i]);
+                    picker->pWeapons[i] = nullptr;
+                }
+                else if (!city->weapon_pool.count(weapon_type(i)))
+                {
+                    picker->get_weapon(weapon_type(i));
+                    city->weapon_pool.emplace(weapon_type(i), picker->pWeapons[i]);
+                    picker->pWeapons[i] = nullptr;
+                }
+            }
+            picker->pick_weapon();
+        });
+    }
+    {
+        Bench map(4);
+        map.spawn<Wolf>(map.Red, 2), map.spawn<Wolf>(map.Blue, 2);
+        City *city = map.city + 2;
+        run("City::raise_flag", [&](long long) {
+            city->state = Actively + Win, city->curr_win = city->prev_win = red, city->flag = neutral;
+            city->raise_flag();
+        });
+    }
+    {
+        const int army = 1000;
+        Bench map(army);
+        for (int i = 1; i <= army; ++i)
+        {
+            map.spawn<Wolf>(map.Red, i);
+            map.city[i].curr_win = red;
+        }
+        run("Headquarter::award_elements (1000 warriors)", [&](long long) {
+            map.Red->elements = INT32_MAX / 2;
+            map.Red->award_elements();
+            for (Warrior *warrior : map.Red->pWarriors)
+            {
+                warrior->elements = Warrior::elements_value[wolf];
+            }
+        });
+    }
+    {
+        // The oldest warrior dies and a new one is born, as at the front line; then the army is walked both ways.
+        const int army = 100000;
+        Bench map(4);
+        std::vector<Warrior *> born;
+        for (int i = 0; i < army; ++i)
+        {
+            born.push_back(map.spawn<Wolf>(map.Red, 0));
+        }
+        Roster &roster = map.Red->pWarriors;
+        std::map<int, Warrior *> tree;
+        for (Warrior *warrior : born)
+        {
+            tree.emplace(warrior->id, warrior);
+        }
+        int next_id = army;
+        run("Roster churn (100000 warriors)", [&](long long i) {
+            Warrior *oldest = born[i % army];
+            roster.remove(oldest);
+            roster.push(oldest);
+        });
+        run("std::map churn (100000 warriors)", [&](long long) {
+            auto oldest = tree.begin();
+            Warrior *warrior = oldest->second;
+            tree.erase(oldest);
+            tree.emplace(++next_id, warrior);
+        });
+        run("Roster walk forward and reverse (100000 warriors)", [&](long long) {
+            int count = 0;
+            for (Warrior *warrior : roster)
+            {
+                count += warrior->id;
+            }
+            for (Warrior *warrior : roster.reversed())
+            {
+                count -= warrior->id;
+            }
+            sink = count;
+        });
+        run("std::map walk forward and reverse (100000 warriors)", [&](long long) {
+            int count = 0;
+            for (auto p = tree.begin(); p != tree.end(); ++p)
+            {
+                count += p->second->id;
+            }
+            for (auto p = tree.rbegin(); p != tree.rend(); ++p)
+            {
+                count -= p->second->id;
+            }
+            sink = count;
+        });
+    }
+    {
+        // Whole hours on a map far larger than the cache, so that every pass streams the cities from memory.
+        const int map = 1 << 20;
+        Bench::rules(map);
+        {
+            SerialEngine engine;
+            run("SerialEngine hour, pass per phase (2^20 cities)", [&](long long) {
+                hour = minute = 0, time_limit = 59;
+                simulate(engine);
+            });
+        }
+        {
+            FusedEngine engine;
+            run("FusedEngine hour, fused sweeps (2^20 cities)", [&](long long) {
+                hour = minute = 0, time_limit = 59;
+                simulate(engine);
+            });
+        }
+        {
+            SparseEngine engine;
+            run("SparseEngine hour, occupied cities (2^20 cities)", [&](long long) {
+                hour = minute = 0, time_limit = 59;
+                simulate(engine);
+            });
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1)
+    {
+        filter = argv[1];
+    }
+    // Events are dropped as they are made, so that no formatting or output is timed.
+    event_callback = discard_event;
+    Bench::run_all();
+    return 0;
+}
@@ -0,0 +1,231 @@
+#ifndef WARCRAFT_IO_H
+#define WARCRAFT_IO_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+// Byte formats shared by the library and the executable. Everything here has internal linkage, so that
+// neither exports it.
+namespace
+{
+// A flat byte buffer for handing state between processes. Reads past the end, or of a bool that is
+// neither 0 nor 1, leave the value zero and mark the archive failed.
+class Archive
+{
+private:
+    std::string data;
+
+    size_t pos = 0;
+
+    bool failed = 0;
+
+public:
+    Archive() {}
+
+    Archive(const std::string &_data) : data(_data) {}
+
+    const std::string &str() const { return data; }
+
+    template <class T>
+    Archive &operator<<(const T &value)
+    {
+        data.append(reinterpret_cast<const char *>(&value), sizeof value);
+        return *this;
+    }
+
+    Archive &operator<<(const std::string &value)
+    {
+        *this << uint64_t(value.size());
+        data += value;
+        return *this;
+    }
+
+    template <class T>
+    Archive &operator>>(T &value)
+    {
+        if (failed || sizeof value > data.size() - pos)
+        {
+            memset(&value, 0, sizeof value);
+            failed = 1;
+            return *this;
+        }
+        memcpy(&value, data.data() + pos, sizeof value);
+        pos += sizeof value;
+        return *this;
+    }
+
+    Archive &operator>>(bool &value)
+    {
+        unsigned char byte;
+        *this >> byte;
+        failed |= byte > 1;
+        value = byte == 1;
+        return *this;
+    }
+
+    Archive &operator>>(std::string &value)
+    {
+        uint64_t size;
+        *this >> size;
+        if (size > data.size() - pos)
+        {
+            failed = 1;
+        }
+        if (failed)
+        {
+            value.clear();
+            return *this;
+        }
+        value.assign(data, pos, size), pos += size;
+        return *this;
+    }
+
+    // Reads an enum written by <<, which must be at most last.
+    template <class T>
+    Archive &read_enum(T &value, const int &last)
+    {
+        int raw;
+        *this >> raw;
+        if (raw < 0 || raw > last)
+        {
+            failed = 1, raw = 0;
+        }
+        value = T(raw);
+        return *this;
+    }
+
+    // Marks the archive failed when a value read from it is out of range.
+    void fail() { failed = 1; }
+
+    bool ok() const { return !failed; }
+
+    // Whether every byte has been read, and read well.
+    bool done() const { return !failed && pos == data.size(); }
+};
+
+void put_varint(std::string &out, uint64_t value)
+{
+    for (; value >= 0x80; value >>= 7)
+    {
+        out += char(value | 0x80);
+    }
+    out += char(value);
+}
+
+bool get_varint(const std::string &in, size_t &pos, uint64_t &value)
+{
+    value = 0;
+    for (int shift = 0; pos < in.size() && shift < 64; shift += 7)
+    {
+        unsigned char byte = in[pos++];
+        value |= uint64_t(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// A small LZ77 codec: (literal length, literals, match length, offset) groups, ended by a zero match length.
+// Matches are at most max_match bytes, so that a block expands at most max_expansion times, which bounds
+// what a forged block can make decompress_block() allocate.
+const size_t max_match = 1 << 16, max_expansion = 1 << 14;
+
+std::string compress_block(const std::string &in)
+{
+    const int hash_bits = 16, min_match = 4;
+    std::vector<uint32_t> table(1 << hash_bits, UINT32_MAX);
+    std::string out;
+    put_varint(out, in.size());
+    size_t anchor = 0, i = 0, n = in.size();
+    auto read32 = [&](size_t p) { uint32_t v; memcpy(&v, in.data() + p, 4); return v; };
+    while (i + min_match <= n)
+    {
+        uint32_t v = read32(i), h = (v * 2654435761u) >> (32 - hash_bits), candidate = table[h];
+        table[h] = i;
+        if (candidate == UINT32_MAX || read32(candidate) != v)
+        {
+            ++i;
+            continue;
+        }
+        size_t length = min_match;
+        while (i + length < n && length < max_match && in[candidate + length] == in[i + length])
+        {
+            ++length;
+        }
+        put_varint(out, i - anchor);
+        out.append(in, anchor, i - anchor);
+        put_varint(out, length), put_varint(out, i - candidate);
+        i += length, anchor = i;
+    }
+    put_varint(out, n - anchor);
+    out.append(in, anchor, n - anchor);
+    put_varint(out, 0);
+    return out;
+}
+
+bool decompress_block(const std::string &in, std::string &out)
+{
+    size_t pos = 0;
+    uint64_t size, literals, length, offset;
+    if (!get_varint(in, pos, size) || size / max_expansion > in.size())
+    {
+        return 0;
+    }
+    out.clear(), out.reserve(size);
+    for (;;)
+    {
+        if (!get_varint(in, pos, literals) || literals > in.size() - pos || literals > size - out.size())
+        {
+            return 0;
+        }
+        out.append(in, pos, literals), pos += literals;
+        if (!get_varint(in, pos, length) || length > max_match || length > size - out.size())
+        {
+            return 0;
+        }
+        if (!length)
+        {
+            return out.size() == size;
+        }
+        if (!get_varint(in, pos, offset) || !offset || offset > out.size())
+        {
+            return 0;
+        }
+        for (size_t from = out.size() - offset; length; --length)
+        {
+            out += out[from++];
+        }
+    }
+}
+
+uint64_t fnv1a(const std::string &data)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned char c : data)
+    {
+        hash = (hash ^ c) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+bool write_all(const int &fd, const char *data, size_t size)
+{
+    while (size)
+    {
+        ssize_t written = write(fd, data, size);
+        if (written <= 0)
+        {
+            return 0;
+        }
+        data += written, size -= written;
+    }
+    return 1;
+}
+}
+
+#endif
@@ -0,0 +1,1001 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <iterator>
+#include <chrono>
+#include <deque>
+#include <future>
+#include <thread>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "WarCraft.h"
+#include "WarCraft_io.h"
+
+// The WarCraft executable: options, input and output files, the result cache, compressed output and the
+// server, around the cases the library in WarCraft.cpp prints.
+
+// Persistent store of finished case bodies, keyed by the case header and engine version, for --cache.
+class ResultCache : public warcraft_cache
+{
+private:
+    struct Entry
+    {
+        std::string name;
+
+        long long size;
+
+        timespec used;
+    };
+
+    std::vector<Entry> entries;
+
+    long long total = 0;
+
+    bool loaded = 0;
+
+    std::string path(const std::string &name) { return directory + '/' + name; }
+
+    // Rebuilds the entries from the directory, which serve workers share.
+    void scan()
+    {
+        entries.clear(), total = 0;
+        DIR *dir = opendir(directory.c_str());
+        if (!dir)
+        {
+            return;
+        }
+        while (dirent *item = readdir(dir))
+        {
+            std::string name = item->d_name;
+            struct stat info;
+            if (name.size() != 20 || name.compare(16, 4, ".wcc") || stat(path(name).c_str(), &info))
+            {
+                continue;
+            }
+            entries.push_back({name, (long long)info.st_size, info.st_mtim});
+            total += info.st_size;
+        }
+        closedir(dir);
+    }
+
+    void load()
+    {
+        loaded = 1;
+        mkdir(directory.c_str(), 0755);
+        evict();
+    }
+
+    // Rescans the directory and removes the least recently used entries until it fits, holding a lock on it
+    // so that processes sharing it see the same entries and evict each one once.
+    void evict()
+    {
+        int lock = open(path(".lock").c_str(), O_RDWR | O_CREAT, 0644);
+        if (lock >= 0)
+        {
+            flock(lock, LOCK_EX);
+        }
+        scan();
+        trim();
+        if (lock >= 0)
+        {
+            close(lock);
+        }
+    }
+
+    void trim()
+    {
+        if (total <= capacity)
+        {
+            return;
+        }
+        std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) { return a.used.tv_sec != b.used.tv_sec ? a.used.tv_sec < b.used.tv_sec : a.used.tv_nsec < b.used.tv_nsec; });
+        size_t n = 0;
+        for (; n < entries.size() && total > capacity; ++n)
+        {
+            remove(path(entries[n].name).c_str());
+            total -= entries[n].size, ++evictions;
+        }
+        entries.erase(entries.begin(), entries.begin() + n);
+    }
+
+    Entry *find(const std::string &name)
+    {
+        for (auto &entry : entries)
+        {
+            if (entry.name == name)
+            {
+                return &entry;
+            }
+        }
+        return nullptr;
+    }
+
+public:
+    std::string directory;
+
+    long long capacity = 256LL << 20;
+
+    // Cases printing more than this are not kept, so that their output need not be held while they run.
+    long long largest() override { return capacity / 8; }
+
+    long long hits = 0, misses = 0, evictions = 0;
+
+    bool enabled() { return !directory.empty(); }
+
+    // The file name of an entry is the FNV-1a hash of its key.
+    static std::string name_of(const std::string &key)
+    {
+        char name[21];
+        snprintf(name, sizeof name, "%016llx.wcc", (unsigned long long)fnv1a(key));
+        return name;
+    }
+
+    bool lookup(const std::string &key, std::string &body) override
+    {
+        if (!loaded)
+        {
+            load();
+        }
+        std::string name = name_of(key);
+        std::ifstream file(path(name), std::ios::binary);
+        std::string stored_key, data;
+        uint64_t checksum;
+        if (file && std::getline(file, stored_key) && stored_key == key && file.read(reinterpret_cast<char *>(&checksum), sizeof checksum))
+        {
+            data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+            if (decompress_block(data, body) && fnv1a(body) == checksum)
+            {
+                utimensat(AT_FDCWD, path(name).c_str(), nullptr, 0);
+                if (Entry *entry = find(name))
+                {
+                    clock_gettime(CLOCK_REALTIME, &entry->used);
+                }
+                ++hits;
+                return 1;
+            }
+        }
+        ++misses;
+        return 0;
+    }
+
+    // Writes the entry as the key line, the checksum of the body and the compressed body, under a temporary
+    // name of this process's own, so that workers storing the same key at once never share a file.
+    void store(const std::string &key, const std::string &body) override
+    {
+        static long long stores = 0;
+        std::string name = name_of(key), temporary = path(name + '.' + std::to_string(getpid()) + '.' + std::to_string(++stores) + ".tmp");
+        Archive checksum;
+        checksum << fnv1a(body);
+        std::string data = key + '\n' + checksum.str() + compress_block(body);
+        {
+            std::ofstream file(temporary, std::ios::binary);
+            if (!file.write(data.data(), data.size()))
+            {
+                return;
+            }
+        }
+        if (rename(temporary.c_str(), path(name).c_str()))
+        {
+            remove(temporary.c_str());
+            return;
+        }
+        evict();
+    }
+
+    void report()
+    {
+        if (!enabled())
+        {
+            return;
+        }
+        std::cerr << "cache: " << hits << " hits, " << misses << " misses, " << evictions << " evictions, " << entries.size() << " entries, " << total << " bytes" << std::endl;
+    }
+} cache;
+
+// The output as independently compressed blocks of whole cases, from --compress. Blocks are compressed on
+// background threads, as many at a time as there are threads, and written in order; a case much longer than
+// a block is cut at a line. The file is a tag, then per block its compressed size, the checksum of its text,
+// the first and last case it holds and the compressed bytes, then a block of size 0, an index of
+// (offset, first case, last case) per block, the block count and the tag again.
+const uint64_t output_tag = 0x314b4c4254554f57ULL; // "WOUTBLK1"
+
+class BlockWriter : public std::streambuf
+{
+private:
+    struct Pending
+    {
+        int first, last;
+
+        uint64_t checksum;
+
+        std::future<std::string> packed;
+    };
+
+    struct Entry
+    {
+        uint64_t offset;
+
+        int first, last;
+    };
+
+    static const size_t block_size = 1 << 20;
+
+    std::streambuf *sink;
+
+    size_t threads;
+
+    // Under --stream every case is written out as soon as it ends, in a block of its own if need be.
+    bool flush_cases;
+
+    char buffer[1 << 16];
+
+    std::string text;
+
+    // Cases finished so far, and the case that text starts in.
+    int cases = 0, first_case = 1;
+
+    std::deque<Pending> pending;
+
+    std::vector<Entry> index;
+
+    uint64_t offset = 0;
+
+    void put(const std::string &data)
+    {
+        sink->sputn(data.data(), data.size());
+        offset += data.size();
+    }
+
+    void drain()
+    {
+        text.append(pbase(), pptr() - pbase());
+        setp(buffer, buffer + sizeof buffer);
+    }
+
+    void write_front()
+    {
+        Pending &block = pending.front();
+        std::string packed = block.packed.get();
+        Archive header;
+        header << uint64_t(packed.size()) << block.checksum << block.first << block.last;
+        index.push_back({offset, block.first, block.last});
+        put(header.str()), put(packed);
+        sink->pubsync();
+        pending.pop_front();
+    }
+
+    // Hands the first size bytes of text, which end case last, to a compressing thread.
+    void seal(const size_t &size, const int &last)
+    {
+        std::string block = text.substr(0, size);
+        text.erase(0, size);
+        uint64_t checksum = fnv1a(block);
+        pending.push_back({first_case, last, checksum, std::async(std::launch::async, [](const std::string &raw) { return compress_block(raw); }, std::move(block))});
+        first_case = cases + 1;
+        while (pending.size() > threads)
+        {
+            write_front();
+        }
+    }
+
+protected:
+    int overflow(int c) override
+    {
+        drain();
+        if (c != EOF)
+        {
+            *pptr() = c, pbump(1);
+        }
+        if (text.size() >= 4 * block_size)
+        {
+            // A long case: cut it after its last complete line.
+            size_t end = text.rfind('\n');
+            if (end != std::string::npos)
+            {
+                seal(end + 1, cases + 1);
+            }
+        }
+        return c == EOF ? 0 : c;
+    }
+
+public:
+    BlockWriter(std::streambuf *_sink, const int &_threads, const bool &_flush_cases) : sink(_sink), threads(std::max(_threads, 1)), flush_cases(_flush_cases)
+    {
+        setp(buffer, buffer + sizeof buffer);
+        Archive tag;
+        tag << output_tag;
+        put(tag.str());
+    }
+
+    void end_case()
+    {
+        drain();
+        ++cases;
+        if (text.size() >= block_size || (flush_cases && !text.empty()))
+        {
+            seal(text.size(), cases);
+        }
+        while (flush_cases && !pending.empty())
+        {
+            write_front();
+        }
+    }
+
+    // Writes the last block and the index.
+    void close()
+    {
+        drain();
+        if (!text.empty())
+        {
+            seal(text.size(), std::max(cases, first_case));
+        }
+        while (!pending.empty())
+        {
+            write_front();
+        }
+        Archive footer;
+        footer << uint64_t(0);
+        for (Entry &entry : index)
+        {
+            footer << entry.offset << entry.first << entry.last;
+        }
+        footer << uint64_t(index.size()) << output_tag;
+        put(footer.str());
+        sink->pubsync();
+    }
+};
+
+BlockWriter *block_writer = nullptr;
+
+// Reads one block written by BlockWriter and appends its text; returns 0 at the end of the blocks or if
+// the block is damaged, which damaged tells apart.
+bool read_block(std::istream &in, std::string &text, bool &damaged)
+{
+    uint64_t size = 0, checksum;
+    int first, last;
+    damaged = 0;
+    if (!in.read(reinterpret_cast<char *>(&size), sizeof size) || !size)
+    {
+        damaged = !in;
+        return 0;
+    }
+    in.read(reinterpret_cast<char *>(&checksum), sizeof checksum).read(reinterpret_cast<char *>(&first), sizeof first).read(reinterpret_cast<char *>(&last), sizeof last);
+    std::string packed, block;
+    if (in && size < (1ULL << 40))
+    {
+        packed.resize(size);
+        in.read(&packed[0], size);
+    }
+    if (!in || !decompress_block(packed, block) || fnv1a(block) != checksum)
+    {
+        damaged = 1;
+        return 0;
+    }
+    text += block;
+    return 1;
+}
+
+// Writes the text of a file from --compress to standard output: all of it, read front to back from path
+// or standard input if path is "-", or only case k, found through the index.
+int decompress(const char *path, const int &k)
+{
+    std::ifstream file;
+    if (strcmp(path, "-"))
+    {
+        file.open(path, std::ios::binary);
+    }
+    std::istream &in = strcmp(path, "-") ? file : std::cin;
+    uint64_t tag = 0;
+    if (!in.read(reinterpret_cast<char *>(&tag), sizeof tag) || tag != output_tag)
+    {
+        std::cerr << path << " is not a compressed output file" << std::endl;
+        return 1;
+    }
+    std::string text;
+    bool damaged;
+    if (!k)
+    {
+        while (read_block(in, text, damaged))
+        {
+            std::cout << text << std::flush;
+            text.clear();
+        }
+        if (damaged)
+        {
+            std::cerr << path << " has a damaged block" << std::endl;
+        }
+        return damaged;
+    }
+    in.seekg(0, std::ios::end);
+    long long size = in.tellg(), count_at = size - 2 * sizeof(uint64_t);
+    uint64_t count = 0;
+    const uint64_t entry_size = sizeof(uint64_t) + 2 * sizeof(int);
+    if (count_at > 0)
+    {
+        in.seekg(count_at);
+        in.read(reinterpret_cast<char *>(&count), sizeof count).read(reinterpret_cast<char *>(&tag), sizeof tag);
+    }
+    if (!in || tag != output_tag || count > uint64_t(count_at) / entry_size)
+    {
+        std::cerr << path << " has no index" << std::endl;
+        return 1;
+    }
+    std::string index(count * entry_size, '\0');
+    in.seekg(count_at - index.size());
+    in.read(&index[0], index.size());
+    Archive entries(index);
+    for (uint64_t i = 0; i < count; ++i)
+    {
+        uint64_t offset;
+        int first, last;
+        entries >> offset >> first >> last;
+        if (first <= k && k <= last && !(in.seekg(offset) && read_block(in, text, damaged)))
+        {
+            std::cerr << path << " has a damaged block" << std::endl;
+            return 1;
+        }
+    }
+    std::string header = "Case " + std::to_string(k) + ":\n", next = "\nCase " + std::to_string(k + 1) + ":\n";
+    size_t begin = 0;
+    if (text.compare(0, header.size(), header))
+    {
+        begin = text.find('\n' + header);
+        if (begin == std::string::npos)
+        {
+            std::cerr << "no case " << k << " in " << path << std::endl;
+            return 1;
+        }
+        ++begin;
+    }
+    size_t end = text.find(next, begin);
+    std::cout << text.substr(begin, end == std::string::npos ? std::string::npos : end + 1 - begin) << std::flush;
+    return 0;
+}
+
+bool stream_mode = 0;
+
+// The options the library runs cases under.
+warcraft_options options;
+
+// One JSON record per case from --stats.
+std::ofstream stats_file;
+
+// One JSON record per case from --memory.
+std::ofstream memory_file;
+
+// The Unix socket given to --serve or --connect.
+const char *serve_path = nullptr, *connect_path = nullptr;
+
+int serve_workers = 4;
+
+// Seconds a serve worker waits for a client to send or take anything before dropping it.
+int serve_idle_seconds = 10;
+
+// The file given to --trace.
+const char *trace_path = nullptr;
+
+// --compress writes blocks compressed by this many threads, 0 for one per core; --decompress reads them.
+bool compress_output = 0;
+
+int compress_threads = 0;
+
+const char *decompress_path = nullptr;
+
+int decompress_case = 0;
+
+// The keyframe file and the hours given to --replay.
+const char *replay_path = nullptr;
+
+int replay_from = 0, replay_to = 0;
+
+bool parse_options(int argc, char *argv[])
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!strcmp(argv[i], "--stream"))
+        {
+            stream_mode = 1;
+        }
+        else if (!strcmp(argv[i], "--shards") && i + 1 < argc)
+        {
+            options.shards = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--engine") && i + 1 < argc && (!strcmp(argv[i + 1], "serial") || !strcmp(argv[i + 1], "fused") || !strcmp(argv[i + 1], "sparse") || !strcmp(argv[i + 1], "auto")))
+        {
+            options.engine = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--serve") && i + 1 < argc)
+        {
+            serve_path = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--workers") && i + 1 < argc && atoi(argv[i + 1]) > 0)
+        {
+            serve_workers = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--idle-timeout") && i + 1 < argc && atoi(argv[i + 1]) > 0)
+        {
+            serve_idle_seconds = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--connect") && i + 1 < argc)
+        {
+            connect_path = argv[++i];
+        }
+        else if ((!strcmp(argv[i], "--stats") || !strcmp(argv[i], "--memory")) && i + 1 < argc)
+        {
+            std::ofstream &file = !strcmp(argv[i], "--stats") ? stats_file : memory_file;
+            file.open(argv[++i]);
+            if (!file)
+            {
+                std::cerr << "cannot open " << argv[i] << std::endl;
+                return 0;
+            }
+        }
+        else if (!strcmp(argv[i], "--memory-limit") && i + 1 < argc)
+        {
+            options.memory_limit = atoll(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--keyframes") && i + 1 < argc)
+        {
+            options.keyframes = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--keyframe-every") && i + 1 < argc && atoi(argv[i + 1]) > 0)
+        {
+            options.keyframe_every = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--replay") && i + 3 < argc && atoi(argv[i + 2]) >= 0 && atoi(argv[i + 3]) >= atoi(argv[i + 2]))
+        {
+            replay_path = argv[++i];
+            replay_from = atoi(argv[++i]), replay_to = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--compress"))
+        {
+            compress_output = 1;
+        }
+        else if (!strcmp(argv[i], "--compress-threads") && i + 1 < argc && atoi(argv[i + 1]) > 0)
+        {
+            compress_threads = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--report-threads") && i + 1 < argc && atoi(argv[i + 1]) > 0)
+        {
+            options.report_threads = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--decompress") && i + 1 < argc)
+        {
+            decompress_path = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--case") && i + 1 < argc && atoi(argv[i + 1]) > 0)
+        {
+            decompress_case = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--trace") && i + 1 < argc)
+        {
+            trace_path = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--budget") && i + 1 < argc)
+        {
+            options.budget_ms = atoll(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--cache") && i + 1 < argc)
+        {
+            cache.directory = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--cache-size") && i + 1 < argc)
+        {
+            cache.capacity = atoll(argv[++i]);
+        }
+        else
+        {
+            std::cerr << "usage: " << argv[0] << " [--stream | --serve PATH [--workers N] [--idle-timeout S] | --connect PATH] [--engine serial|fused|sparse|auto] [--shards N] [--stats FILE] [--memory FILE] [--memory-limit BYTES] [--keyframes DIR [--keyframe-every N] | --replay FILE FROM TO] [--budget MS] [--trace FILE] [--compress [--compress-threads N] | --decompress FILE|- [--case K]] [--report-threads N] [--cache DIR] [--cache-size BYTES]" << std::endl;
+            return 0;
+        }
+    }
+    if (compress_output && (serve_path || connect_path))
+    {
+        std::cerr << "--compress cannot be used with --serve or --connect" << std::endl;
+        return 0;
+    }
+    return 1;
+}
+
+// Cases skipped for a continuation token that is damaged, forged or from another version.
+int rejected_cases = 0;
+
+bool read_config(warcraft_config &config)
+{
+    if (!(std::cin >> config.elements >> config.cities >> config.arrow_attack >> config.loyalty_decrease >> config.time_limit))
+    {
+        return 0;
+    }
+    for (int &elements : config.warrior_elements)
+    {
+        std::cin >> elements;
+    }
+    for (int &force : config.warrior_force)
+    {
+        std::cin >> force;
+    }
+    return bool(std::cin);
+}
+
+// Prints the lines of hours from to to of the case whose keyframes are in path.
+int replay(const char *path, const int &from, const int &to)
+{
+    int result = warcraft_replay(path, from, to, nullptr, nullptr);
+    if (result == -1)
+    {
+        std::cerr << path << " is not a keyframe file" << std::endl;
+    }
+    else if (result)
+    {
+        std::cerr << "no usable keyframe at or before hour " << from << " in " << path << std::endl;
+    }
+    return result ? 1 : 0;
+}
+
+// Reads the case count and runs the cases that follow it; returns how many were run. A case is a header,
+// or "resume" and the token printed by a case suspended by --budget.
+int run_cases()
+{
+    int cases, k = 0;
+    if (!(std::cin >> cases))
+    {
+        return 0;
+    }
+    while (k < cases && !std::cout.bad())
+    {
+        std::cin >> std::ws;
+        if (std::cin.peek() == 'r')
+        {
+            std::string word, token;
+            if (!(std::cin >> word >> token))
+            {
+                break;
+            }
+            ++k;
+            if (word != "resume" || warcraft_resume(token, k) < 0)
+            {
+                std::cerr << "case " << k << ": bad continuation token, skipped" << std::endl;
+                ++rejected_cases;
+                continue;
+            }
+        }
+        else
+        {
+            warcraft_config config;
+            if (!read_config(config) || warcraft_print(config, k + 1, cache.enabled() ? &cache : nullptr) < 0)
+            {
+                break;
+            }
+            ++k;
+        }
+        if (block_writer)
+        {
+            block_writer->end_case();
+        }
+        std::cout << std::flush;
+        warcraft_trace_flush();
+        // A case whose output was lost is not recorded as if it had finished.
+        if (std::cout.bad())
+        {
+            break;
+        }
+        if (stats_file.is_open())
+        {
+            warcraft_stats(stats_file, k);
+        }
+        if (memory_file.is_open())
+        {
+            warcraft_memory(memory_file, k);
+        }
+    }
+    return k;
+}
+
+// A stream buffer over a socket. A serving worker keeps one for its whole life, so its buffers are
+// allocated once rather than per connection.
+class SocketBuffer : public std::streambuf
+{
+private:
+    int fd = -1;
+
+    std::vector<char> input, output;
+
+    long long sent = 0;
+
+protected:
+    int underflow() override
+    {
+        ssize_t got;
+        while ((got = read(fd, input.data(), input.size())) < 0 && errno == EINTR)
+        {
+        }
+        if (got <= 0)
+        {
+            return traits_type::eof();
+        }
+        setg(input.data(), input.data(), input.data() + got);
+        return traits_type::to_int_type(*gptr());
+    }
+
+    int overflow(int c) override
+    {
+        if (sync())
+        {
+            return traits_type::eof();
+        }
+        if (!traits_type::eq_int_type(c, traits_type::eof()))
+        {
+            *pptr() = traits_type::to_char_type(c), pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+    int sync() override
+    {
+        size_t size = pptr() - pbase();
+        if (size && !write_all(fd, pbase(), size))
+        {
+            return -1;
+        }
+        sent += size;
+        setp(output.data(), output.data() + output.size());
+        return 0;
+    }
+
+public:
+    SocketBuffer() : input(1 << 16), output(1 << 16) {}
+
+    void attach(const int &socket)
+    {
+        fd = socket, sent = 0;
+        setg(input.data(), input.data(), input.data());
+        setp(output.data(), output.data() + output.size());
+    }
+
+    long long bytes_sent() const { return sent; }
+};
+
+volatile sig_atomic_t stopping = 0;
+
+void stop_serving(int) { stopping = 1; }
+
+// Takes connections on the shared listening socket one at a time: each carries input in the data.in
+// format and gets the output back as every case finishes. One latency line per request goes to stderr.
+void serve_requests(const int &listener)
+{
+    signal(SIGTERM, SIG_DFL), signal(SIGINT, SIG_DFL), signal(SIGPIPE, SIG_IGN);
+    warcraft_start();
+    SocketBuffer buffer;
+    std::streambuf *in = std::cin.rdbuf(), *out = std::cout.rdbuf();
+    int backoff = 0;
+    for (long long request = 1;; ++request)
+    {
+        int fd = accept(listener, nullptr, nullptr);
+        if (fd < 0)
+        {
+            // Out of descriptors or memory: wait, up to a second at a time, for some to be released rather than spin.
+            if (errno != EINTR && errno != ECONNABORTED)
+            {
+                if (!backoff)
+                {
+                    perror("accept");
+                }
+                backoff = std::min(backoff ? 2 * backoff : 10, 1000);
+                poll(nullptr, 0, backoff);
+            }
+            continue;
+        }
+        backoff = 0;
+        // Each worker serves one connection at a time, so an idle client must not hold it for ever.
+        timeval idle = {serve_idle_seconds, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof idle), setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &idle, sizeof idle);
+        auto start = std::chrono::steady_clock::now();
+        double trace_start = warcraft_trace_now();
+        long long hits = cache.hits, misses = cache.misses;
+        buffer.attach(fd);
+        std::cin.rdbuf(&buffer), std::cout.rdbuf(&buffer);
+        int cases = run_cases();
+        std::cout << std::flush;
+        std::cin.rdbuf(in), std::cout.rdbuf(out);
+        std::cin.clear(), std::cout.clear();
+        close(fd);
+        long long latency = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+        std::cerr << "worker " << getpid() << " request " << request << ": " << cases << " cases, " << buffer.bytes_sent() << " bytes, " << latency << " us";
+        if (cache.enabled())
+        {
+            std::cerr << ", cache " << cache.hits - hits << " hits, " << cache.misses - misses << " misses";
+        }
+        std::cerr << std::endl;
+        if (trace_path)
+        {
+            warcraft_trace_span("request " + std::to_string(request), trace_start, "{\"cases\":" + std::to_string(cases) + '}');
+            warcraft_trace_flush();
+        }
+    }
+}
+
+pid_t start_worker(const int &listener)
+{
+    warcraft_trace_flush();
+    pid_t pid = fork();
+    if (!pid)
+    {
+        warcraft_trace_process("serve worker");
+        serve_requests(listener);
+        _exit(0);
+    }
+    return pid;
+}
+
+bool unix_address(const char *path, sockaddr_un &address)
+{
+    memset(&address, 0, sizeof address);
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof address.sun_path)
+    {
+        std::cerr << "socket path too long: " << path << std::endl;
+        return 0;
+    }
+    strcpy(address.sun_path, path);
+    return 1;
+}
+
+// Listens on path with a pool of forked workers, replacing any that die, until SIGINT or SIGTERM.
+int serve(const char *path)
+{
+    sockaddr_un address;
+    if (!unix_address(path, address))
+    {
+        return 1;
+    }
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path);
+    if (listener < 0 || bind(listener, reinterpret_cast<sockaddr *>(&address), sizeof address) || listen(listener, 128))
+    {
+        perror(path);
+        return 1;
+    }
+    struct sigaction action;
+    memset(&action, 0, sizeof action);
+    action.sa_handler = stop_serving;
+    sigaction(SIGTERM, &action, nullptr), sigaction(SIGINT, &action, nullptr);
+    std::vector<pid_t> workers;
+    for (int i = 0; i < serve_workers; ++i)
+    {
+        workers.push_back(start_worker(listener));
+    }
+    std::cerr << "serving " << path << " with " << serve_workers << " workers" << std::endl;
+    while (!stopping)
+    {
+        pid_t pid = wait(nullptr);
+        for (pid_t &worker : workers)
+        {
+            if (pid > 0 && worker == pid && !stopping)
+            {
+                worker = start_worker(listener);
+            }
+        }
+    }
+    for (pid_t worker : workers)
+    {
+        kill(worker, SIGTERM);
+    }
+    for (pid_t worker : workers)
+    {
+        waitpid(worker, nullptr, 0);
+    }
+    close(listener);
+    unlink(path);
+    return 0;
+}
+
+// Sends standard input to a server at path and copies its answer to standard output.
+int connect_to(const char *path)
+{
+    sockaddr_un address;
+    if (!unix_address(path, address))
+    {
+        return 1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof address))
+    {
+        perror(path);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    std::vector<char> chunk(1 << 16);
+    pollfd ends[2] = {{STDIN_FILENO, POLLIN, 0}, {fd, POLLIN, 0}};
+    while (poll(ends, 2, -1) >= 0)
+    {
+        if (ends[0].revents)
+        {
+            ssize_t got = read(STDIN_FILENO, chunk.data(), chunk.size());
+            if (got <= 0 || !write_all(fd, chunk.data(), got))
+            {
+                ends[0].fd = -1;
+                shutdown(fd, SHUT_WR);
+            }
+        }
+        if (ends[1].revents)
+        {
+            ssize_t got = read(fd, chunk.data(), chunk.size());
+            if (got <= 0)
+            {
+                break;
+            }
+            write_all(STDOUT_FILENO, chunk.data(), got);
+        }
+    }
+    close(fd);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (!parse_options(argc, argv))
+    {
+        return 1;
+    }
+    warcraft_setup(options);
+    if (trace_path && !warcraft_trace(trace_path))
+    {
+        std::cerr << "cannot open " << trace_path << std::endl;
+        return 1;
+    }
+    warcraft_trace_process("WarCraft");
+    if (serve_path)
+    {
+        return serve(serve_path);
+    }
+    if (connect_path)
+    {
+        return connect_to(connect_path);
+    }
+    if (replay_path)
+    {
+        return replay(replay_path, replay_from, replay_to);
+    }
+    if (decompress_path)
+    {
+        return decompress(decompress_path, decompress_case);
+    }
+    if (!stream_mode)
+    {
+        freopen("data.in", "r", stdin);
+        freopen(compress_output ? "WarCraft.out.wcz" : "WarCraft.out", "w", stdout);
+    }
+    std::streambuf *sink = std::cout.rdbuf();
+    if (compress_output)
+    {
+        block_writer = new BlockWriter(sink, compress_threads ? compress_threads : std::thread::hardware_concurrency(), stream_mode);
+        std::cout.rdbuf(block_writer);
+    }
+    warcraft_start();
+    run_cases();
+    warcraft_stop();
+    if (block_writer)
+    {
+        block_writer->close();
+        std::cout.rdbuf(sink);
+        delete block_writer;
+    }
+    cache.report();
+    warcraft_trace_flush();
+    return rejected_cases ? 1 : 0;
+}